@@ -593,8 +593,8 @@ class ESPLoader(object):
             stub = self.STUB_CODE
             load_start = offset
             load_end = offset + size
-            for (start, end) in [(stub["data_start"], stub["data_start"] + len(stub["data"])),
-                                 (stub["text_start"], stub["text_start"] + len(stub["text"]))]:
+            for (start, end) in [(stub["data_start"], stub["data_start"] + stub.get("data_len", len(stub.get("data", b"")))),
+                                 (stub["text_start"], stub["text_start"] + stub.get("text_len", len(stub.get("text", b""))))]:
                 if load_start < end and load_end > start:
                     raise FatalError(("Software loader is resident at 0x%08x-0x%08x. " +
                                       "Can't load binary at overlapping address range 0x%08x-0x%08x. " +
@@ -710,7 +710,14 @@ class ESPLoader(object):
 
         # Upload
         print("Uploading stub...")
-        for field in ['text', 'data']:
+        if 'payload' in stub:
+            # compressed stub image, the loader inflates the rest into place
+            fields = ['loader', 'payload']
+            entry = stub['loader_entry']
+        else:
+            fields = ['text', 'data']
+            entry = stub['entry']
+        for field in fields:
             if field in stub:
                 offs = stub[field + "_start"]
                 length = len(stub[field])
@@ -721,7 +728,7 @@ class ESPLoader(object):
                     to_offs = from_offs + self.ESP_RAM_BLOCK
                     self.mem_block(stub[field][from_offs:to_offs], seq)
         print("Running stub...")
-        self.mem_finish(stub['entry'])
+        self.mem_finish(entry)
 
         p = self.read()
         if p != b'OHAI':
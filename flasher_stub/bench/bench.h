@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2016-2019 Espressif Systems (Shanghai) PTE LTD
+ * All rights reserved
+ *
+ * This file is part of the esptool.py binary flasher stub.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51 Franklin
+ * Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Host benchmark build of the stub: simulated SPI flash and serial link
+   shared between bench_mocks.c and bench_main.c */
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+
+#define BENCH_FLASH_SIZE (4 * 1024 * 1024)
+
+/* Simulated flash contents */
+extern uint8_t bench_flash[BENCH_FLASH_SIZE];
+
+/* Counts of SPI flash commands issued, and simulated time the flash chip
+   spent busy on them (using typical datasheet timings) */
+typedef struct {
+  uint32_t sector_erases;
+  uint32_t block32_erases;
+  uint32_t block64_erases;
+  uint32_t chip_erases;
+  uint32_t page_programs;
+  uint64_t busy_us;
+  uint32_t protocol_errors; /* command issued while busy, or without WREN */
+} bench_flash_stats_t;
+
+extern bench_flash_stats_t bench_flash_stats;
+
+/* Fill the simulated flash with a pattern which isn't all 0xFF,
+   so writes without an erase show up when verifying */
+void bench_flash_reset(void);
+
+/* Host side of the serial link: queue of SLIP encoded command frames
+   which the simulated receive interrupt feeds to the stub, one at a
+   time once each previous command has been answered. */
+void bench_host_reset(void);
+void bench_host_send(uint8_t op, const void *data, uint32_t data_len, uint32_t checksum);
+
+typedef struct {
+  uint32_t responses;
+  uint32_t failures; /* responses with a non-zero error byte */
+  uint8_t last_error;
+  int32_t last_value;
+  uint8_t last_data[256]; /* data of the last response, if any */
+  uint32_t last_data_len;
+} bench_host_result_t;
+
+extern bench_host_result_t bench_host_result;
+
+/* Capture everything the stub sends into buf instead of parsing it as
+   responses, returns the previous capture length. NULL to stop capturing. */
+uint32_t bench_tx_capture(uint8_t *buf, uint32_t max_len);
+
+/* Receive callback the stub registered with stub_io_init() */
+void bench_rx_buf(const uint8_t *data, uint32_t len);
+
+uint64_t bench_now_ns(void);
@@ -0,0 +1,636 @@
+/*
+ * Copyright (c) 2016-2019 Espressif Systems (Shanghai) PTE LTD
+ * All rights reserved
+ *
+ * This file is part of the esptool.py binary flasher stub.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51 Franklin
+ * Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Host throughput benchmarks for the stub, run by "make bench".
+
+   Usage: stub_bench [IMAGE ZLIB_COMPRESSED_IMAGE]...
+
+   (images are LZ4 compressed for the LZ4 write benchmarks here, with a
+   simple compressor, as there's no LZ4 module for Python by default)
+
+   Each benchmark is repeated and the best time is reported, the flash
+   write benchmarks go through stub_main() and cmd_loop() exactly as
+   esptool.py would drive them, and check the simulated flash afterwards.
+   Exits non-zero if anything fails, so it can be used as a gate.
+
+   The per-phase breakdown comes from GET_STATS. Receiving happens in
+   interrupt context in the middle of other phases (here, whenever the
+   stub calls stub_io_idle_hook()), so the percentages can add up to
+   more than 100.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bench.h"
+#include "slip.h"
+#include "stub_flasher.h"
+#include "stub_stats.h"
+
+#define REPEAT 5
+#define BLOCK_SIZE 0x4000 /* matches the ESP8266 RX buffer */
+#define SLIP_BENCH_LEN (1024 * 1024)
+
+void stub_main();
+
+static int s_failed;
+
+static double mb_per_s(uint64_t bytes, uint64_t ns)
+{
+  return ns ? (bytes / (1024.0 * 1024.0)) / (ns / 1e9) : 0;
+}
+
+static uint8_t *read_file(const char *path, uint32_t *len)
+{
+  FILE *f = fopen(path, "rb");
+  if (f == NULL) {
+    perror(path);
+    exit(2);
+  }
+  fseek(f, 0, SEEK_END);
+  *len = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  uint8_t *buf = malloc(*len ? *len : 1);
+  if (fread(buf, 1, *len, f) != *len) {
+    perror(path);
+    exit(2);
+  }
+  fclose(f);
+  return buf;
+}
+
+static const char *basename_of(const char *path)
+{
+  const char *p = strrchr(path, '/');
+  return p ? p + 1 : path;
+}
+
+static uint32_t payload_checksum(const uint8_t *data, uint32_t len)
+{
+  uint8_t res = 0xef;
+  for (uint32_t i = 0; i < len; i++) {
+    res ^= data[i];
+  }
+  return res;
+}
+
+static void send_words(uint8_t op, const uint32_t *words, uint32_t num_words)
+{
+  bench_host_send(op, words, num_words * 4, 0);
+}
+
+/* Send the data words header plus payload, as for FLASH_DATA */
+static void send_data(uint8_t op, uint32_t seq, const uint8_t *data, uint32_t len)
+{
+  static uint8_t frame[16 + BLOCK_SIZE];
+  uint32_t words[4] = { len, seq, 0, 0 };
+  memcpy(frame, words, sizeof(words));
+  memcpy(frame + 16, data, len);
+  bench_host_send(op, frame, 16 + len, payload_checksum(data, len));
+}
+
+/* Queue GET_STATS + RUN_USER_CODE after whatever has been sent, run the
+   stub until it exits, returns the elapsed time. */
+static uint64_t run_stub(stub_stats_t *stats)
+{
+  bench_host_send(ESP_GET_STATS, NULL, 0, 0);
+  bench_host_send(ESP_RUN_USER_CODE, NULL, 0, 0);
+
+  uint64_t start = bench_now_ns();
+  stub_main();
+  uint64_t elapsed = bench_now_ns() - start;
+
+  memcpy(stats, bench_host_result.last_data, sizeof(*stats));
+  return elapsed;
+}
+
+static void check(bool ok, const char *what)
+{
+  if (!ok) {
+    printf("FAILED: %s\n", what);
+    s_failed = 1;
+  }
+}
+
+static void print_breakdown(const stub_stats_t *s, uint64_t total_ns)
+{
+  double total = total_ns;
+  printf("    rx %.0f%%  checksum %.0f%%  inflate %.0f%%  erase wait %.0f%%  flash write %.0f%%\n",
+         100 * s->cycles_rx / total, 100 * s->cycles_checksum / total,
+         100 * s->cycles_inflate / total, 100 * s->cycles_erase_wait / total,
+         100 * s->cycles_flash_write / total);
+}
+
+static void print_flash_stats(void)
+{
+  const bench_flash_stats_t *f = &bench_flash_stats;
+  printf("    flash: %u SE, %u BE32, %u BE64, %u PP, busy %.2f s\n",
+         f->sector_erases, f->block32_erases, f->block64_erases,
+         f->page_programs, f->busy_us / 1e6);
+}
+
+static void bench_slip(void)
+{
+  uint8_t *in = malloc(SLIP_BENCH_LEN);
+  uint8_t *encoded = malloc(2 * SLIP_BENCH_LEN);
+  uint8_t *decoded = malloc(SLIP_BENCH_LEN);
+  uint32_t encoded_len = 0;
+  uint64_t best_enc = UINT64_MAX, best_dec = UINT64_MAX;
+
+  srand(1);
+  for (uint32_t i = 0; i < SLIP_BENCH_LEN; i++) {
+    in[i] = rand();
+  }
+
+  for (int r = 0; r < REPEAT; r++) {
+    bench_tx_capture(encoded, 2 * SLIP_BENCH_LEN);
+    uint64_t start = bench_now_ns();
+    SLIP_send_frame_data_buf(in, SLIP_BENCH_LEN);
+    uint64_t t = bench_now_ns() - start;
+    encoded_len = bench_tx_capture(NULL, 0);
+    if (t < best_enc) {
+      best_enc = t;
+    }
+  }
+
+  for (int r = 0; r < REPEAT; r++) {
+    slip_state_t state = SLIP_FRAME;
+    uint32_t out_len = 0;
+    bool finished = false;
+    uint64_t start = bench_now_ns();
+    /* a FIFO's worth at a time, like the receive interrupt */
+    for (uint32_t pos = 0; pos < encoded_len; ) {
+      uint32_t n = encoded_len - pos;
+      if (n > 128) {
+        n = 128;
+      }
+      while (n > 0) {
+        uint32_t used = SLIP_recv_buf(encoded + pos, n, &state, decoded, &out_len,
+                                      SLIP_BENCH_LEN + 1, &finished);
+        pos += used;
+        n -= used;
+      }
+    }
+    uint64_t t = bench_now_ns() - start;
+    if (t < best_dec) {
+      best_dec = t;
+    }
+    check(out_len == SLIP_BENCH_LEN && memcmp(in, decoded, SLIP_BENCH_LEN) == 0,
+          "SLIP decode matches");
+  }
+
+  printf("slip encode                %8.1f MB/s\n", mb_per_s(SLIP_BENCH_LEN, best_enc));
+  printf("slip decode                %8.1f MB/s\n", mb_per_s(SLIP_BENCH_LEN, best_dec));
+  free(in);
+  free(encoded);
+  free(decoded);
+}
+
+/* Greedy LZ4 block compressor (one hash table probe per position), good
+   enough to produce a stream in the ESP_FLASH_LZ4_DATA format. Blocks are
+   FLASH_LZ4_MAX_BLOCK_SIZE, stored if they don't compress. */
+#define LZ4_HASH_BITS 12
+#define LZ4_MIN_MATCH 4
+
+static uint32_t lz4_put_length(uint8_t *out, uint32_t len)
+{
+  uint32_t n = 0;
+  for (len -= 15; len >= 255; len -= 255) {
+    out[n++] = 255;
+  }
+  out[n++] = len;
+  return n;
+}
+
+static uint32_t lz4_compress_block(const uint8_t *in, uint32_t len, uint8_t *out)
+{
+  static uint32_t table[1 << LZ4_HASH_BITS];
+  uint32_t o = 0, anchor = 0, i = 0;
+
+  memset(table, 0xff, sizeof(table));
+  /* the format wants the last match to start 12 bytes before the end,
+     and the last 5 bytes to be literals */
+  while (len >= 12 && i < len - 12) {
+    uint32_t v;
+    memcpy(&v, in + i, 4);
+    uint32_t h = (v * 2654435761u) >> (32 - LZ4_HASH_BITS);
+    uint32_t cand = table[h];
+    table[h] = i;
+    if (cand == UINT32_MAX || i - cand > 0xffff || memcmp(in + cand, in + i, 4) != 0) {
+      i++;
+      continue;
+    }
+    uint32_t m = LZ4_MIN_MATCH;
+    while (i + m < len - 5 && in[cand + m] == in[i + m]) {
+      m++;
+    }
+    uint32_t lit = i - anchor;
+    uint8_t *token = &out[o++];
+    *token = ((lit < 15 ? lit : 15) << 4) | (m - 4 < 15 ? m - 4 : 15);
+    if (lit >= 15) {
+      o += lz4_put_length(out + o, lit);
+    }
+    memcpy(out + o, in + anchor, lit);
+    o += lit;
+    out[o++] = (i - cand) & 0xff;
+    out[o++] = (i - cand) >> 8;
+    if (m - 4 >= 15) {
+      o += lz4_put_length(out + o, m - 4);
+    }
+    i += m;
+    anchor = i;
+  }
+  uint32_t lit = len - anchor;
+  out[o++] = (lit < 15 ? lit : 15) << 4;
+  if (lit >= 15) {
+    o += lz4_put_length(out + o, lit);
+  }
+  memcpy(out + o, in + anchor, lit);
+  return o + lit;
+}
+
+static uint8_t *lz4_compress(const uint8_t *in, uint32_t len, uint32_t *out_len)
+{
+  uint8_t *out = malloc(len + len / 64 + 64);
+  uint32_t o = 0;
+  for (uint32_t pos = 0; pos < len; pos += FLASH_LZ4_MAX_BLOCK_SIZE) {
+    uint32_t n = len - pos;
+    if (n > FLASH_LZ4_MAX_BLOCK_SIZE) {
+      n = FLASH_LZ4_MAX_BLOCK_SIZE;
+    }
+    static uint8_t block[FLASH_LZ4_MAX_BLOCK_SIZE * 2];
+    uint32_t size = lz4_compress_block(in + pos, n, block);
+    if (size >= n) {
+      size = n | FLASH_LZ4_STORED;
+      memcpy(block, in + pos, n);
+    }
+    memcpy(out + o, &size, 4);
+    size &= ~FLASH_LZ4_STORED;
+    memcpy(out + o + 4, block, size);
+    o += 4 + size;
+  }
+  memset(out + o, 0, 4); /* end mark */
+  *out_len = o + 4;
+  return out;
+}
+
+typedef enum {
+  WRITE_PLAIN,
+  WRITE_DEFLATE,
+  WRITE_LZ4,
+} write_codec_t;
+
+/* FLASH_BEGIN / FLASH_DATA... / FLASH_END, or the DEFLATED or LZ4
+   versions with the matching 'compressed' data */
+static void bench_write(const char *name, const uint8_t *image, uint32_t len,
+                        write_codec_t codec, const uint8_t *compressed, uint32_t compressed_len)
+{
+  static const uint8_t ops[][3] = {
+    [WRITE_PLAIN] = { ESP_FLASH_BEGIN, ESP_FLASH_DATA, ESP_FLASH_END },
+    [WRITE_DEFLATE] = { ESP_FLASH_DEFLATED_BEGIN, ESP_FLASH_DEFLATED_DATA, ESP_FLASH_DEFLATED_END },
+    [WRITE_LZ4] = { ESP_FLASH_LZ4_BEGIN, ESP_FLASH_LZ4_DATA, ESP_FLASH_LZ4_END },
+  };
+  static const char *names[] = { "write", "deflate", "lz4" };
+  const uint8_t *data = compressed ? compressed : image;
+  uint32_t data_len = compressed ? compressed_len : len;
+  uint32_t num_blocks = (data_len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  uint64_t best = UINT64_MAX;
+  stub_stats_t best_stats = { 0 };
+
+  if (len > BENCH_FLASH_SIZE) {
+    printf("%s: too big for the simulated flash\n", name);
+    s_failed = 1;
+    return;
+  }
+
+  for (int r = 0; r < REPEAT; r++) {
+    stub_stats_t stats;
+    bench_flash_reset();
+    bench_host_reset();
+
+    uint32_t begin[4] = { len, num_blocks, BLOCK_SIZE, 0 };
+    send_words(ops[codec][0], begin, 4);
+    for (uint32_t i = 0; i < num_blocks; i++) {
+      uint32_t n = data_len - i * BLOCK_SIZE;
+      if (n > BLOCK_SIZE) {
+        n = BLOCK_SIZE;
+      }
+      send_data(ops[codec][1], i, data + i * BLOCK_SIZE, n);
+    }
+    uint32_t end = 1; /* stay in the stub */
+    send_words(ops[codec][2], &end, 1);
+
+    uint64_t t = run_stub(&stats);
+    if (t < best) {
+      best = t;
+      best_stats = stats;
+    }
+    check(bench_host_result.failures == 0, "all commands succeed");
+    check(memcmp(bench_flash, image, len) == 0, "flash contents match image");
+    check(bench_flash_stats.protocol_errors == 0, "no SPI flash protocol errors");
+  }
+
+  if (num_blocks >= 3) {
+    /* a block lost in between (ie to a receive window overrun) must
+       fail the ones after it, not write them in its place */
+    stub_stats_t stats;
+    bench_flash_reset();
+    bench_host_reset();
+    uint32_t begin[4] = { len, num_blocks, BLOCK_SIZE, 0 };
+    send_words(ops[codec][0], begin, 4);
+    send_data(ops[codec][1], 0, data, BLOCK_SIZE);
+    send_data(ops[codec][1], 2, data + 2 * BLOCK_SIZE, BLOCK_SIZE);
+    run_stub(&stats);
+    check(bench_host_result.failures == 1, "out of sequence data block is refused");
+  }
+
+  printf("%-10s %-26.26s %8.1f MB/s  (%u%% size)\n", names[codec], name, mb_per_s(len, best),
+         len ? (uint32_t)(100ull * data_len / len) : 100);
+  print_breakdown(&best_stats, best);
+  print_flash_stats();
+}
+
+/* Deflated write where the last data block is just the zlib trailer
+   (adler32), so all of the output can be written before it arrives */
+static void bench_deflate_trailer(const uint8_t *image, uint32_t len, const uint8_t *compressed, uint32_t compressed_len)
+{
+  uint32_t head_len = compressed_len - 4;
+  uint32_t num_blocks = (head_len + BLOCK_SIZE - 1) / BLOCK_SIZE + 1;
+  stub_stats_t stats;
+
+  bench_flash_reset();
+  bench_host_reset();
+  uint32_t begin[4] = { len, num_blocks, BLOCK_SIZE, 0 };
+  send_words(ESP_FLASH_DEFLATED_BEGIN, begin, 4);
+  uint32_t seq = 0;
+  for (uint32_t offs = 0; offs < head_len; offs += BLOCK_SIZE) {
+    uint32_t n = head_len - offs;
+    if (n > BLOCK_SIZE) {
+      n = BLOCK_SIZE;
+    }
+    send_data(ESP_FLASH_DEFLATED_DATA, seq++, compressed + offs, n);
+  }
+  send_data(ESP_FLASH_DEFLATED_DATA, seq, compressed + head_len, 4);
+  uint32_t end = 1;
+  send_words(ESP_FLASH_DEFLATED_END, &end, 1);
+  run_stub(&stats);
+
+  check(bench_host_result.failures == 0, "deflated write with the trailer in its own block succeeds");
+  check(memcmp(bench_flash, image, len) == 0, "flash contents match image");
+}
+
+/* One FLASH_SEGMENTS_BEGIN session writing the image as three segments:
+   the second starts part way through the sector the first ends in, the
+   third is further along. The data stream is then just the image. */
+static void bench_segments(const char *name, const uint8_t *image, uint32_t len,
+                           write_codec_t codec, const uint8_t *data, uint32_t data_len)
+{
+  static const uint8_t data_ops[] = { ESP_FLASH_DATA, ESP_FLASH_DEFLATED_DATA, ESP_FLASH_LZ4_DATA };
+  static const uint8_t end_ops[] = { ESP_FLASH_END, ESP_FLASH_DEFLATED_END, ESP_FLASH_LZ4_END };
+  uint32_t sizes[3] = { (len / 4) & ~3, (len / 8) & ~3, 0 };
+  sizes[2] = len - sizes[0] - sizes[1];
+  uint32_t offsets[3];
+  offsets[0] = 0x1000;
+  offsets[1] = offsets[0] + sizes[0] + 100;
+  offsets[2] = ((offsets[1] + sizes[1]) & ~0xffff) + 0x20000 + 0x3000;
+  uint32_t num_blocks = (data_len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  uint64_t best = UINT64_MAX;
+
+  if (offsets[2] + sizes[2] > BENCH_FLASH_SIZE) {
+    printf("%s: too big for the simulated flash\n", name);
+    s_failed = 1;
+    return;
+  }
+
+  for (int r = 0; r < REPEAT; r++) {
+    stub_stats_t stats;
+    bench_flash_reset();
+    bench_host_reset();
+
+    uint32_t begin[4 + 6] = { codec, num_blocks * BLOCK_SIZE, BLOCK_SIZE, 0 };
+    for (int i = 0; i < 3; i++) {
+      begin[4 + i * 2] = offsets[i];
+      begin[5 + i * 2] = sizes[i];
+    }
+    send_words(ESP_FLASH_SEGMENTS_BEGIN, begin, 10);
+    for (uint32_t i = 0; i < num_blocks; i++) {
+      uint32_t n = data_len - i * BLOCK_SIZE;
+      if (n > BLOCK_SIZE) {
+        n = BLOCK_SIZE;
+      }
+      send_data(data_ops[codec], i, data + i * BLOCK_SIZE, n);
+    }
+    uint32_t end = 1; /* stay in the stub */
+    send_words(end_ops[codec], &end, 1);
+
+    uint64_t t = run_stub(&stats);
+    if (t < best) {
+      best = t;
+    }
+    check(bench_host_result.failures == 0, "all segment commands succeed");
+    const uint8_t *p = image;
+    for (int i = 0; i < 3; i++) {
+      check(memcmp(bench_flash + offsets[i], p, sizes[i]) == 0, "flash contents match each segment");
+      p += sizes[i];
+    }
+    check(bench_flash_stats.protocol_errors == 0, "no SPI flash protocol errors");
+  }
+
+  /* a segment boundary which isn't word aligned is refused */
+  stub_stats_t stats;
+  bench_host_reset();
+  uint32_t unaligned[4 + 4] = { codec, num_blocks * BLOCK_SIZE, BLOCK_SIZE, 0,
+                                offsets[0], sizes[0] + 1, offsets[1], sizes[1] };
+  send_words(ESP_FLASH_SEGMENTS_BEGIN, unaligned, 8);
+  run_stub(&stats);
+  check(bench_host_result.failures == 1, "unaligned segment size is rejected");
+
+  printf("%-10s %-26.26s %8.1f MB/s  (3 segments)\n", codec == WRITE_LZ4 ? "seg lz4" : "seg write",
+         name, mb_per_s(len, best));
+  print_flash_stats();
+}
+
+/* FLASH_COPY of the image (already in flash) to a second region, then a
+   FLASH_FILL over that with a pattern that doesn't divide into words */
+static void bench_copy_fill(const char *name, const uint8_t *image, uint32_t len)
+{
+  static const uint8_t pattern[] = { 0x12, 0x34, 0x00, 0xff, 0x56 };
+  const uint32_t src = 0x10000;
+  const uint32_t dst = 0x10000 + ((len + 0xffff) & ~0xffff);
+  uint64_t best_copy = UINT64_MAX;
+  uint64_t best_fill = UINT64_MAX;
+
+  if (dst + len > BENCH_FLASH_SIZE) {
+    printf("%s: too big for the simulated flash\n", name);
+    s_failed = 1;
+    return;
+  }
+
+  for (int r = 0; r < REPEAT; r++) {
+    stub_stats_t stats;
+    bench_flash_reset();
+    memcpy(bench_flash + src, image, len);
+    bench_host_reset();
+    uint32_t copy[3] = { src, dst, len };
+    send_words(ESP_FLASH_COPY, copy, 3);
+    uint64_t t = run_stub(&stats);
+    if (t < best_copy) {
+      best_copy = t;
+    }
+    check(bench_host_result.failures == 0, "FLASH_COPY succeeds");
+    check(memcmp(bench_flash + dst, image, len) == 0, "copy matches the source");
+    check(bench_flash_stats.protocol_errors == 0, "no SPI flash protocol errors");
+
+    bench_host_reset();
+    uint8_t fill[8 + sizeof(pattern)];
+    uint32_t fill_words[2] = { dst, len - 3 };
+    memcpy(fill, fill_words, 8);
+    memcpy(fill + 8, pattern, sizeof(pattern));
+    bench_host_send(ESP_FLASH_FILL, fill, sizeof(fill), 0);
+    t = run_stub(&stats);
+    if (t < best_fill) {
+      best_fill = t;
+    }
+    check(bench_host_result.failures == 0, "FLASH_FILL succeeds");
+    bool filled = true;
+    for (uint32_t i = 0; i < len - 3; i++) {
+      filled = filled && bench_flash[dst + i] == pattern[i % sizeof(pattern)];
+    }
+    check(filled, "fill repeats the pattern");
+    check(bench_flash_stats.protocol_errors == 0, "no SPI flash protocol errors");
+  }
+
+  /* bytes clear of each other, but erasing dst's sector would take out
+     the source first */
+  stub_stats_t stats;
+  bench_flash_reset();
+  memcpy(bench_flash + 0x1000, image, 0x800);
+  bench_host_reset();
+  uint32_t overlap[3] = { 0x1000, 0x1800, 0x800 };
+  send_words(ESP_FLASH_COPY, overlap, 3);
+  run_stub(&stats);
+  check(bench_host_result.failures == 1, "FLASH_COPY into the source's sector is refused");
+  check(memcmp(bench_flash + 0x1000, image, 0x800) == 0, "refused copy leaves the source alone");
+
+  /* nor may it take over a flashing session the host has open */
+  bench_host_reset();
+  uint32_t begin[4] = { 0, 0, BLOCK_SIZE, 0x100000 };
+  send_words(ESP_FLASH_BEGIN, begin, 4);
+  uint32_t copy[3] = { 0x1000, 0x10000, 0x800 };
+  send_words(ESP_FLASH_COPY, copy, 3);
+  uint32_t end = 1; /* stay in the stub */
+  send_words(ESP_FLASH_END, &end, 1);
+  run_stub(&stats);
+  check(bench_host_result.failures == 1, "FLASH_COPY during a flashing session is refused");
+  check(memcmp(bench_flash + 0x10000, image, 0x800) != 0, "refused copy writes nothing");
+
+  /* same for a deflated RAM load, which would take over the inflator */
+  bench_host_reset();
+  send_words(ESP_FLASH_BEGIN, begin, 4);
+  uint32_t mem_begin[4] = { 0x800, 1, 0x800, 0 };
+  send_words(ESP_MEM_DEFLATED_BEGIN, mem_begin, 4);
+  send_data(ESP_FLASH_DATA, 0, image, BLOCK_SIZE);
+  send_words(ESP_FLASH_END, &end, 1);
+  run_stub(&stats);
+  check(bench_host_result.failures == 1, "MEM_DEFLATED_BEGIN during a flashing session is refused");
+
+  printf("%-10s %-26.26s %8.1f MB/s\n", "copy", name, mb_per_s(len, best_copy));
+  printf("%-10s %-26.26s %8.1f MB/s\n", "fill", name, mb_per_s(len - 3, best_fill));
+}
+
+/* Erase planner: commands used and simulated erase time for some
+   typical regions, most of them not 64KB aligned */
+static void bench_erase_schedule(void)
+{
+  static const uint32_t regions[][2] = {
+    { 0x1000, 0x7000 },     /* ESP32 bootloader */
+    { 0x8000, 0x1000 },     /* partition table */
+    { 0x9000, 0x6000 },     /* nvs */
+    { 0x10000, 0x100000 },  /* 1MB app */
+    { 0x11000, 0xf0000 },   /* unaligned app */
+    { 0x3000, 0x2d000 },
+    { 0x0, 0x400000 },      /* whole chip */
+  };
+  uint64_t total_us = 0;
+
+  for (int i = 0; i < sizeof(regions) / sizeof(regions[0]); i++) {
+    stub_stats_t stats;
+    bench_flash_reset();
+    bench_host_reset();
+    send_words(ESP_ERASE_REGION, regions[i], 2);
+    run_stub(&stats);
+
+    check(bench_host_result.failures == 0, "erase succeeds");
+    check(bench_flash_stats.protocol_errors == 0, "no SPI flash protocol errors");
+    for (uint32_t a = regions[i][0]; a < regions[i][0] + regions[i][1]; a++) {
+      if (bench_flash[a] != 0xff) {
+        check(false, "region is erased");
+        break;
+      }
+    }
+
+    const bench_flash_stats_t *f = &bench_flash_stats;
+    printf("erase 0x%06x+0x%06x     %3u SE %3u BE32 %3u BE64 %8.0f ms\n",
+           regions[i][0], regions[i][1], f->sector_erases, f->block32_erases,
+           f->block64_erases, f->busy_us / 1e3);
+    total_us += f->busy_us;
+  }
+  printf("erase total                %8.0f ms\n", total_us / 1e3);
+
+  /* a background erase can't take over a flashing session's erase-ahead */
+  stub_stats_t stats;
+  bench_host_reset();
+  uint32_t begin[4] = { 0, 0, BLOCK_SIZE, 0 };
+  send_words(ESP_FLASH_BEGIN, begin, 4);
+  uint32_t erase[3] = { 0x10000, 0x10000, ERASE_ASYNC };
+  send_words(ESP_ERASE_REGION, erase, 3);
+  uint32_t end = 1; /* stay in the stub */
+  send_words(ESP_FLASH_END, &end, 1);
+  run_stub(&stats);
+  check(bench_host_result.failures == 1, "ERASE_ASYNC during a flashing session is refused");
+}
+
+int main(int argc, char **argv)
+{
+  bench_slip();
+
+  for (int i = 1; i + 1 < argc; i += 2) {
+    uint32_t len, compressed_len;
+    uint8_t *image = read_file(argv[i], &len);
+    uint8_t *compressed = read_file(argv[i + 1], &compressed_len);
+    uint32_t lz4_len;
+    uint8_t *lz4 = lz4_compress(image, len, &lz4_len);
+    bench_write(basename_of(argv[i]), image, len, WRITE_PLAIN, NULL, 0);
+    bench_write(basename_of(argv[i]), image, len, WRITE_DEFLATE, compressed, compressed_len);
+    bench_deflate_trailer(image, len, compressed, compressed_len);
+    bench_write(basename_of(argv[i]), image, len, WRITE_LZ4, lz4, lz4_len);
+    bench_segments(basename_of(argv[i]), image, len, WRITE_PLAIN, image, len);
+    bench_segments(basename_of(argv[i]), image, len, WRITE_LZ4, lz4, lz4_len);
+    bench_copy_fill(basename_of(argv[i]), image, len);
+    free(image);
+    free(compressed);
+    free(lz4);
+  }
+
+  bench_erase_schedule();
+
+  if (s_failed) {
+    printf("bench FAILED\n");
+  }
+  return s_failed;
+}
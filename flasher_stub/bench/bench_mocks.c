@@ -0,0 +1,464 @@
+/*
+ * Copyright (c) 2016-2019 Espressif Systems (Shanghai) PTE LTD
+ * All rights reserved
+ *
+ * This file is part of the esptool.py binary flasher stub.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51 Franklin
+ * Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Stand-ins for the ROM functions, SPI flash peripheral and serial link,
+   so the stub (built for ESP8266 with -DSTUB_BENCH) runs on the host.
+
+   The SPI flash model executes the commands the stub issues through the
+   SPI registers, and keeps simulated time: each command makes the chip
+   busy for its typical datasheet duration, and the next status read
+   finishes it. So wall clock time measures the stub's own CPU work, and
+   bench_flash_stats.busy_us what the flash chip would have added.
+*/
+#define _POSIX_C_SOURCE 199309L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "bench.h"
+#include "soc_support.h"
+#include "rom_functions.h"
+#include "stub_flasher.h"
+#include "stub_io.h"
+
+/* Typical timings, close to most 16-128Mbit NOR flash chips */
+#define T_PP_US    700
+#define T_SE_US    45000
+#define T_BE32_US  120000
+#define T_BE64_US  150000
+#define T_CE_US    10000000
+
+uint8_t bench_flash[BENCH_FLASH_SIZE];
+bench_flash_stats_t bench_flash_stats;
+
+/* Linker script symbols */
+#define BENCH_RX_BUF_SIZE (2 * (0x4000 + 64))
+uint8_t _rx_buf_start[BENCH_RX_BUF_SIZE];
+uint32_t _bss_start;
+__asm__(".globl _rx_buf_end\n"
+        ".set _rx_buf_end, _rx_buf_start + 0x8080\n"
+        ".globl _bss_end\n"
+        ".set _bss_end, _bss_start\n" /* nothing for stub_main() to zero */
+        ".globl _noinit_end\n"
+        ".set _noinit_end, _bss_start\n"
+        ".globl _text_start\n"
+        ".set _text_start, _bss_start\n"
+        ".globl _text_end\n"
+        ".set _text_end, _bss_start\n");
+
+_Static_assert(BENCH_RX_BUF_SIZE == 0x8080, "update _rx_buf_end");
+
+uint64_t bench_now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* stub_stats cycles are nanoseconds, see ets_get_cpu_frequency() */
+uint32_t bench_ccount(void)
+{
+  return (uint32_t)bench_now_ns();
+}
+
+/*
+ * SPI flash
+ */
+static uint32_t s_spi_regs[0x100 / 4];
+static uint64_t s_sim_us;
+static uint64_t s_busy_until_us;
+static bool s_write_enabled;
+
+void bench_flash_reset(void)
+{
+  for (uint32_t i = 0; i < BENCH_FLASH_SIZE; i++) {
+    bench_flash[i] = (uint8_t)(i * 7 + 0x55);
+  }
+  memset(&bench_flash_stats, 0, sizeof(bench_flash_stats));
+  s_busy_until_us = s_sim_us;
+  s_write_enabled = false;
+}
+
+static bool flash_busy(void)
+{
+  return s_sim_us < s_busy_until_us;
+}
+
+static void flash_wait(void)
+{
+  if (flash_busy()) {
+    s_sim_us = s_busy_until_us;
+  }
+}
+
+/* Start a write operation, returns false if the chip isn't ready for it */
+static bool flash_write_op(uint32_t duration_us)
+{
+  if (flash_busy() || !s_write_enabled) {
+    bench_flash_stats.protocol_errors++;
+    return false;
+  }
+  s_write_enabled = false;
+  s_busy_until_us = s_sim_us + duration_us;
+  bench_flash_stats.busy_us += duration_us;
+  return true;
+}
+
+static void flash_erase(uint32_t addr, uint32_t len, uint32_t duration_us)
+{
+  addr &= ~(len - 1);
+  if (addr + len > BENCH_FLASH_SIZE || !flash_write_op(duration_us)) {
+    return;
+  }
+  memset(bench_flash + addr, 0xff, len);
+}
+
+static void flash_program(uint32_t addr, const uint8_t *data, uint32_t len)
+{
+  /* wraps around within the page, like the real thing */
+  uint32_t page = addr & ~(FLASH_PAGE_SIZE - 1);
+  for (uint32_t i = 0; i < len; i++) {
+    uint32_t a = page + ((addr + i) % FLASH_PAGE_SIZE);
+    if (a < BENCH_FLASH_SIZE) {
+      bench_flash[a] &= data[i];
+    }
+  }
+}
+
+static void spi_command(uint32_t cmd)
+{
+  uint32_t addr_reg = s_spi_regs[(SPI_ADDR_REG - SPI_BASE_REG) / 4];
+  uint32_t addr = addr_reg & 0xffffff;
+
+  if (cmd & SPI_FLASH_RDSR) {
+    s_spi_regs[(SPI_RD_STATUS_REG - SPI_BASE_REG) / 4] = flash_busy() ? 1 : 0; /* WIP bit */
+    flash_wait(); /* ready by the time the stub asks again */
+  } else if (cmd & SPI_FLASH_WREN) {
+    s_write_enabled = true;
+  } else if (cmd & SPI_FLASH_SE) {
+    bench_flash_stats.sector_erases++;
+    flash_erase(addr, FLASH_SECTOR_SIZE, T_SE_US);
+  } else if (cmd & SPI_FLASH_BE) {
+    bench_flash_stats.block64_erases++;
+    flash_erase(addr, FLASH_BLOCK_SIZE, T_BE64_US);
+  } else if (cmd & SPI_FLASH_CE) {
+    bench_flash_stats.chip_erases++;
+    flash_erase(0, BENCH_FLASH_SIZE, T_CE_US);
+  } else if (cmd & SPI_FLASH_PP) {
+    uint8_t data[SPI_W_NUM * 4];
+    for (int i = 0; i < SPI_W_NUM; i++) {
+      uint32_t w = s_spi_regs[(SPI_W0_REG - SPI_BASE_REG) / 4 + i];
+      memcpy(data + i * 4, &w, 4);
+    }
+    uint32_t len = addr_reg >> SPI_ADDR_LEN_S;
+    bench_flash_stats.page_programs++;
+    if (len <= sizeof(data) && flash_write_op(T_PP_US)) {
+      flash_program(addr, data, len);
+    }
+  } else if (cmd & SPI_USR) {
+    uint32_t user2 = s_spi_regs[(SPI_USER2_REG - SPI_BASE_REG) / 4];
+    if ((user2 & 0xffff) == 0x52) {
+      bench_flash_stats.block32_erases++;
+      flash_erase(addr_reg >> 8, FLASH_HALF_BLOCK_SIZE, T_BE32_US);
+    } else {
+      bench_flash_stats.protocol_errors++;
+    }
+  }
+}
+
+uint32_t bench_read_reg(uint32_t reg)
+{
+  if (reg == SPI_CMD_REG || reg == SPI_EXT2_REG) {
+    return 0; /* commands complete immediately */
+  }
+  if (reg >= SPI_BASE_REG && reg < SPI_BASE_REG + sizeof(s_spi_regs)) {
+    return s_spi_regs[(reg - SPI_BASE_REG) / 4];
+  }
+  return 0;
+}
+
+void bench_write_reg(uint32_t reg, uint32_t val)
+{
+  if (reg == SPI_CMD_REG) {
+    spi_command(val);
+  } else if (reg >= SPI_BASE_REG && reg < SPI_BASE_REG + sizeof(s_spi_regs)) {
+    s_spi_regs[(reg - SPI_BASE_REG) / 4] = val;
+  }
+}
+
+/*
+ * ROM functions
+ */
+SpiFlashOpResult SPIUnlock()
+{
+  return SPI_FLASH_RESULT_OK;
+}
+
+SpiFlashOpResult SPIRead(uint32_t addr, void *dst, uint32_t size)
+{
+  flash_wait();
+  if (addr + size > BENCH_FLASH_SIZE) {
+    return SPI_FLASH_RESULT_ERR;
+  }
+  memcpy(dst, bench_flash + addr, size);
+  return SPI_FLASH_RESULT_OK;
+}
+
+SpiFlashOpResult SPIWrite(uint32_t addr, const uint8_t *src, uint32_t size)
+{
+  while (size > 0) {
+    uint32_t n = FLASH_PAGE_SIZE - (addr % FLASH_PAGE_SIZE);
+    if (n > size) {
+      n = size;
+    }
+    flash_wait();
+    s_write_enabled = true;
+    bench_flash_stats.page_programs++;
+    flash_write_op(T_PP_US);
+    flash_program(addr, src, n);
+    addr += n;
+    src += n;
+    size -= n;
+  }
+  return SPI_FLASH_RESULT_OK;
+}
+
+SpiFlashOpResult SPIEraseChip()
+{
+  flash_wait();
+  s_write_enabled = true;
+  bench_flash_stats.chip_erases++;
+  flash_erase(0, BENCH_FLASH_SIZE, T_CE_US);
+  flash_wait();
+  return SPI_FLASH_RESULT_OK;
+}
+
+uint32_t SPIParamCfg(uint32_t deviceId, uint32_t chip_size, uint32_t block_size, uint32_t sector_size, uint32_t page_size, uint32_t status_mask)
+{
+  return 0;
+}
+
+void SPIReadModeCnfig(uint32_t a) { }
+void SelectSpiFunction() { }
+void spi_flash_attach() { }
+void ets_delay_us(uint32_t us) { }
+void ets_set_user_start(void (*user_start_fn)()) { }
+
+uint32_t ets_get_cpu_frequency(void)
+{
+  return 1000; /* bench_ccount() counts nanoseconds */
+}
+
+void software_reset()
+{
+  fprintf(stderr, "stub tried to reset\n");
+  exit(1);
+}
+
+/* Not benchmarked, verification is done against bench_flash instead */
+void MD5Init(struct MD5Context *ctx)
+{
+  memset(ctx, 0, sizeof(*ctx));
+}
+
+void MD5Update(struct MD5Context *ctx, void *buf, uint32_t len) { }
+
+void MD5Final(uint8_t digest[16], struct MD5Context *ctx)
+{
+  memset(digest, 0, 16);
+}
+
+/*
+ * Serial link
+ */
+static void(*s_rx_buf_cb_func)(const uint8_t *, uint32_t);
+
+static uint8_t *s_host_buf;
+static uint32_t s_host_len;
+static uint32_t s_host_cap;
+static uint32_t *s_frame_ends;
+static uint32_t s_num_frames;
+static uint32_t s_frames_cap;
+static uint32_t s_host_pos;
+static uint32_t s_frames_fed;
+
+bench_host_result_t bench_host_result;
+
+static uint8_t *s_capture;
+static uint32_t s_capture_len;
+static uint32_t s_capture_max;
+
+/* response being decoded */
+static uint8_t s_resp[0x10000];
+static uint32_t s_resp_len;
+static bool s_resp_escaping;
+
+void bench_host_reset(void)
+{
+  s_host_len = 0;
+  s_host_pos = 0;
+  s_num_frames = 0;
+  s_frames_fed = 0;
+  memset(&bench_host_result, 0, sizeof(bench_host_result));
+}
+
+static void host_put_raw(uint8_t b)
+{
+  if (s_host_len + 1 > s_host_cap) {
+    s_host_cap = s_host_cap ? s_host_cap * 2 : 0x10000;
+    s_host_buf = realloc(s_host_buf, s_host_cap);
+  }
+  s_host_buf[s_host_len++] = b;
+}
+
+static void host_put(uint8_t b)
+{
+  if (b == 0xc0 || b == 0xdb) {
+    host_put_raw(0xdb);
+    host_put_raw((b == 0xc0) ? 0xdc : 0xdd);
+  } else {
+    host_put_raw(b);
+  }
+}
+
+void bench_host_send(uint8_t op, const void *data, uint32_t data_len, uint32_t checksum)
+{
+  uint8_t header[8] = { 0, op, data_len & 0xff, data_len >> 8,
+                        checksum & 0xff, (checksum >> 8) & 0xff, (checksum >> 16) & 0xff, checksum >> 24 };
+  const uint8_t *p = data;
+
+  host_put_raw(0xc0);
+  for (int i = 0; i < sizeof(header); i++) {
+    host_put(header[i]);
+  }
+  for (uint32_t i = 0; i < data_len; i++) {
+    host_put(p[i]);
+  }
+  host_put_raw(0xc0);
+
+  if (s_num_frames == s_frames_cap) {
+    s_frames_cap = s_frames_cap ? s_frames_cap * 2 : 256;
+    s_frame_ends = realloc(s_frame_ends, s_frames_cap * sizeof(uint32_t));
+  }
+  s_frame_ends[s_num_frames++] = s_host_len;
+}
+
+void bench_rx_buf(const uint8_t *data, uint32_t len)
+{
+  (*s_rx_buf_cb_func)(data, len);
+}
+
+void stub_io_init(void(*rx_buf_cb_func)(const uint8_t *, uint32_t))
+{
+  s_rx_buf_cb_func = rx_buf_cb_func;
+}
+
+/* Acts as the UART receive interrupt: hands over the next frame a
+   FIFO's worth at a time, once every frame so far has been answered.
+   That keeps one frame queued while the stub processes the last one,
+   like esptool.py does. */
+void stub_io_idle_hook(void)
+{
+  if (s_frames_fed == s_num_frames || s_frames_fed != bench_host_result.responses) {
+    return;
+  }
+  uint32_t end = s_frame_ends[s_frames_fed++];
+  while (s_host_pos < end) {
+    uint32_t n = end - s_host_pos;
+    if (n > UART_FIFO_SIZE) {
+      n = UART_FIFO_SIZE;
+    }
+    bench_rx_buf(s_host_buf + s_host_pos, n);
+    s_host_pos += n;
+  }
+}
+
+static void host_response_finished(void)
+{
+  if (s_resp_len < 10 || s_resp[0] != 1) {
+    return; /* not a command response, ie the greeting */
+  }
+  bench_host_result_t *r = &bench_host_result;
+  r->responses++;
+  memcpy(&r->last_value, s_resp + 4, 4);
+  r->last_error = s_resp[s_resp_len - 2];
+  if (r->last_error != 0) {
+    r->failures++;
+  }
+  r->last_data_len = s_resp_len - 10;
+  if (r->last_data_len > sizeof(r->last_data)) {
+    r->last_data_len = sizeof(r->last_data);
+  }
+  memcpy(r->last_data, s_resp + 8, r->last_data_len);
+}
+
+uint32_t bench_tx_capture(uint8_t *buf, uint32_t max_len)
+{
+  uint32_t len = s_capture_len;
+  s_capture = buf;
+  s_capture_max = max_len;
+  s_capture_len = 0;
+  return len;
+}
+
+void stub_tx_buf(const void *buf, uint32_t len)
+{
+  const uint8_t *p = buf;
+  if (s_capture) {
+    if (len > s_capture_max - s_capture_len) {
+      len = s_capture_max - s_capture_len;
+    }
+    memcpy(s_capture + s_capture_len, p, len);
+    s_capture_len += len;
+    return;
+  }
+  for (uint32_t i = 0; i < len; i++) {
+    uint8_t b = p[i];
+    if (b == 0xc0) {
+      if (s_resp_len > 0) {
+        host_response_finished();
+      }
+      s_resp_len = 0;
+      s_resp_escaping = false;
+    } else if (s_resp_escaping) {
+      s_resp[s_resp_len++] = (b == 0xdc) ? 0xc0 : 0xdb;
+      s_resp_escaping = false;
+    } else if (b == 0xdb) {
+      s_resp_escaping = true;
+    } else if (s_resp_len < sizeof(s_resp)) {
+      s_resp[s_resp_len++] = b;
+    }
+  }
+}
+
+void stub_tx_one_char(char c)
+{
+  stub_tx_buf(&c, 1);
+}
+
+void stub_tx_push(void) { }
+void stub_tx_flush(void) { }
+void stub_rx_async_enable(bool enable) { }
+void stub_io_set_baudrate(uint32_t current_baud, uint32_t new_baud) { }
+
+char stub_rx_one_char(void)
+{
+  fprintf(stderr, "stub tried to receive synchronously\n");
+  exit(1);
+}
@@ -7,11 +7,15 @@ import sys
 # (Used by Travis to verify the stubs are up to date.)
 
 def verbose_diff(new, old):
-    for k in [ "data_start", "text_start"]:
+    # (either may be the compressed stub format, see wrap_stub.py)
+    for k in sorted(set(new.keys()) ^ set(old.keys())):
+        print("%s only in the %s stub" % (k, "new" if k in new else "old"))
+    keys = sorted(set(new.keys()) & set(old.keys()))
+    for k in [k for k in keys if isinstance(new[k], int)]:
         if new[k] != old[k]:
-            print("New %s 0x%x old %s 0%x" % (k, new[k], old[k]))
+            print("New %s 0x%x old %s 0x%x" % (k, new[k], k, old[k]))
 
-    for k in [ "data", "text" ]:
+    for k in [k for k in keys if not isinstance(new[k], int)]:
         if len(new[k]) != len(old[k]):
             print("New %s %d bytes, old stub code %d bytes" % (k, len(new[k]), len(old[k])))
         if new[k] != old[k]:
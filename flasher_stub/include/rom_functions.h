@@ -23,6 +23,8 @@
 #pragma once
 
 #include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include "soc_support.h"
 
 #if defined(ESP32S2)
@@ -40,6 +42,7 @@ int send_packet(const void *packet, uint32_t size);
 void _putc1(char *ch);
 
 void ets_delay_us(uint32_t us);
+uint32_t ets_get_cpu_frequency(void);
 
 typedef enum { SPI_FLASH_RESULT_OK = 0,
                SPI_FLASH_RESULT_ERR = 1,
@@ -59,6 +62,7 @@ void spi_flash_attach();
 void SelectSpiFunction();
 void SPIFlashModeConfig(uint32_t a, uint32_t b);
 void SPIReadModeCnfig(uint32_t a);
+void SPIClkConfig(uint8_t freqdiv, uint8_t spi);
 uint32_t SPIParamCfg(uint32_t deviceId, uint32_t chip_size, uint32_t block_size, uint32_t sector_size, uint32_t page_size, uint32_t status_mask);
 
 void ets_delay_us(uint32_t delay_micros);
@@ -98,6 +102,10 @@ int_handler_t ets_isr_attach(uint32_t int_num, int_handler_t handler,
 uint32_t ets_get_detected_xtal_freq(void);
 void uart_tx_flush(int uart);
 uint32_t ets_efuse_get_spiconfig(void);
+#if ESP32 || ESP32S3
+/* APP_CPU calls this once released from reset */
+void ets_set_appcpu_boot_addr(uint32_t start);
+#endif
 
 #if ESP32
 SpiFlashOpResult esp_rom_spiflash_write_encrypted(uint32_t addr, const uint8_t *src, uint32_t size);
@@ -118,6 +126,48 @@ SpiFlashOpResult SPI_read_status_high(uint32_t *status);
 SpiFlashOpResult SPI_write_status(esp_rom_spiflash_chip_t *spi, uint32_t status_value);
 
 void intr_matrix_set(int cpu_no, uint32_t module_num, uint32_t intr_num);
+
+/* SHA hardware accelerator routines. The ESP32 ROM has a different
+   (older) interface to the later chips. */
+void ets_sha_enable(void);
+void ets_sha_disable(void);
+
+#if ESP32
+typedef struct {
+  bool start;
+  uint32_t total_input_bits[4];
+} SHA_CTX;
+
+enum SHA_TYPE {
+  SHA1 = 0,
+  SHA2_256,
+  SHA2_384,
+  SHA2_512,
+};
+
+void ets_sha_init(SHA_CTX *ctx);
+void ets_sha_update(SHA_CTX *ctx, enum SHA_TYPE type, const uint8_t *input, size_t input_bits);
+void ets_sha_finish(SHA_CTX *ctx, enum SHA_TYPE type, uint8_t *output);
+#else
+typedef enum {
+  SHA1 = 0,
+  SHA2_224,
+  SHA2_256,
+} SHA_TYPE;
+
+typedef struct {
+  bool start;
+  bool in_hardware;
+  SHA_TYPE type;
+  uint32_t state[16];
+  uint8_t buffer[128];
+  uint32_t total_bits[4];
+} SHA_CTX;
+
+int ets_sha_init(SHA_CTX *ctx, SHA_TYPE type);
+void ets_sha_update(SHA_CTX *ctx, const uint8_t *input, uint32_t input_bytes, bool update_ctx);
+int ets_sha_finish(SHA_CTX *ctx, uint8_t *output);
+#endif
 #endif /* ESP32 || ESP32S2 */
 
 
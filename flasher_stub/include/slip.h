@@ -19,6 +19,7 @@
 #define SLIP_H_
 
 #include <stdint.h>
+#include <stdbool.h>
 
 /* Send the SLIP frame begin/end delimiter. */
 void SLIP_send_frame_delimiter(void);
@@ -40,6 +41,16 @@ typedef enum {
 
 int16_t SLIP_recv_byte(char byte, slip_state_t *state);
 
+/* Decode a buffer of received SLIP data, continuing from *state.
+
+   Decoded frame data is appended to out, starting at *out_len and stopping
+   at max_len. Stops early after the end of a frame or when out is full,
+   setting *finished. Returns the number of bytes of 'in' consumed.
+*/
+uint32_t SLIP_recv_buf(const uint8_t *in, uint32_t len, slip_state_t *state,
+                       uint8_t *out, uint32_t *out_len, uint32_t max_len,
+                       bool *finished);
+
 #define SLIP_FINISHED_FRAME -2
 #define SLIP_NO_BYTE -1
 
@@ -32,8 +32,16 @@
 #include <stdbool.h>
 #include <stddef.h>
 
+#ifdef STUB_BENCH
+/* Host benchmark build (see bench/), peripherals are simulated */
+uint32_t bench_read_reg(uint32_t reg);
+void bench_write_reg(uint32_t reg, uint32_t val);
+#define READ_REG(REG) bench_read_reg((uint32_t)(REG))
+#define WRITE_REG(REG, VAL) bench_write_reg((uint32_t)(REG), (VAL))
+#else
 #define READ_REG(REG) (*((volatile uint32_t *)(REG)))
 #define WRITE_REG(REG, VAL) *((volatile uint32_t *)(REG)) = (VAL)
+#endif
 #define REG_SET_MASK(reg, mask) WRITE_REG((reg), (READ_REG(reg)|(mask)))
 #define REG_CLR_MASK(reg, mask) WRITE_REG((reg), (READ_REG(reg)&(~(mask))))
 
@@ -42,6 +50,17 @@
 #define ESP32S3_OR_LATER (ESP32S3 || ESP32C3)
 #define ESP32C3_OR_LATER (ESP32C3)
 
+/* Write-behind for compressed writes runs on the APP_CPU of dual core
+   chips, see flash_worker_start(). Build with -DSTUB_DUAL_CORE=0 to keep
+   everything on the PRO_CPU. */
+#ifndef STUB_DUAL_CORE
+#define STUB_DUAL_CORE ((ESP32 || ESP32S3) && !STUB_BENCH)
+#endif
+
+/* Big scratch buffers go in .noinit (see ld/stub_*.ld): not part of the
+   loaded stub image, and not cleared by stub_main() */
+#define STUB_NOINIT __attribute__((section(".noinit")))
+
 /**********************************************************
  * Per-SOC based peripheral register base addresses
  */
@@ -82,6 +101,22 @@
 #define RTCCNTL_BASE_REG   0x60008000
 #endif
 
+/**********************************************************
+ * Internal SRAM
+ *
+ * On these chips the same SRAM shows up on both the instruction bus
+ * (0x40xxxxxx) and the data bus (0x3Fxxxxxx), this far apart
+ */
+#ifdef ESP32S2
+#define SRAM_IRAM_DRAM_OFFSET 0x70000    /* 0x40020000 is 0x3FFB0000 */
+#endif
+#ifdef ESP32S3
+#define SRAM_IRAM_DRAM_OFFSET 0x6F0000   /* 0x40378000 is 0x3FC88000 */
+#endif
+#ifdef ESP32C3
+#define SRAM_IRAM_DRAM_OFFSET 0x700000   /* 0x40380000 is 0x3FC80000 */
+#endif
+
 /**********************************************************
  * UART peripheral
  *
@@ -98,6 +133,7 @@
 #endif
 
 #define UART_FIFO(X)       (UART_BASE_REG + 0x00)
+#define UART_INT_RAW(X)    (UART_BASE_REG + 0x04)
 #define UART_INT_ST(X)     (UART_BASE_REG + 0x08)
 #define UART_INT_ENA(X)    (UART_BASE_REG + 0x0C)
 #define UART_INT_CLR(X)    (UART_BASE_REG + 0x10)
@@ -105,11 +141,26 @@
 
 #if defined(ESP32S2) || defined(ESP32S3)
 #define UART_RXFIFO_CNT_M 0x3FF
+#define UART_TXFIFO_CNT_M 0x3FF
 #else
 #define UART_RXFIFO_CNT_M 0xFF
+#define UART_TXFIFO_CNT_M 0xFF
+#endif
+#define UART_TXFIFO_CNT_S 16
+
+#define UART_FIFO_SIZE     128 /* both RX & TX FIFO */
+
+#ifdef ESP32
+/* ESP32 TX FIFO writes need to go via the AHB address, writes via
+   the DPORT address can be lost */
+#define UART_FIFO_AHB_REG  0x60000000 /* UART0 */
+#else
+#define UART_FIFO_AHB_REG  UART_FIFO(0)
 #endif
 
 #define UART_RXFIFO_FULL_INT_ENA            (1<<0)
+#define UART_TXFIFO_EMPTY_INT_ENA           (1<<1)
+#define UART_RXFIFO_OVF_INT_ENA             (1<<4)
 #define UART_RXFIFO_TOUT_INT_ENA            (1<<8)
 
 #define ETS_UART0_INUM 5
@@ -127,16 +178,61 @@
 #define SPI_CMD_REG       (SPI_BASE_REG + 0x00)
 #define SPI_FLASH_WREN    (1<<30)
 #define SPI_FLASH_RDSR    (1<<27)
+#define SPI_FLASH_PP      (1<<25)
 #define SPI_FLASH_SE      (1<<24)
 #define SPI_FLASH_BE      (1<<23)
+#define SPI_FLASH_CE      (1<<22)
+#define SPI_USR           (1<<18) /* run the command set up in SPI_USERx_REG */
 
 #define SPI_ADDR_REG      (SPI_BASE_REG + 0x04)
+#define SPI_ADDR_LEN_S    24 /* byte count for SPI_FLASH_PP goes in the top 8 bits */
+#if defined(ESP32S2) || defined(ESP32S3) || defined(ESP32C3)
+#define SPI_USR_ADDR_VALUE(A) (A)
+#else
+/* user command address bits are sent starting from bit 31 */
+#define SPI_USR_ADDR_VALUE(A) ((A) << 8)
+#endif
 
 #define SPI_CTRL_REG      (SPI_BASE_REG + 0x08)
 #if defined(ESP32) || defined(ESP32S2) || defined(ESP32S3) || defined(ESP32C3)
 #define SPI_WRSR_2B       (1<<22)
 #endif
 
+#if defined(ESP32S2) || defined(ESP32S3) || defined(ESP32C3)
+#define SPI_CLOCK_REG     (SPI_BASE_REG + 0x14)
+#else
+#define SPI_CLOCK_REG     (SPI_BASE_REG + 0x18)
+#endif
+#ifdef ESP8266
+/* ESP32 & newer have ROM code to set the clock, ESP8266 does not */
+#define SPI_CLK_EQU_SYSCLK (1<<31)
+#define SPI_CLKCNT_N_S    12
+#define SPI_CLKCNT_H_S    6
+#define SPI_CLKCNT_L_S    0
+#define SPI_CLK_DIV_MAX   64   /* clkcnt fields are 6 bits, N holds div - 1 */
+#else
+#define SPI_CLK_DIV_MAX   0xff /* SPIClkConfig() also uses the prescaler */
+#endif
+
+#if defined(ESP32S2) || defined(ESP32S3) || defined(ESP32C3)
+#define SPI_USER_REG      (SPI_BASE_REG + 0x18)
+#define SPI_USER1_REG     (SPI_BASE_REG + 0x1C)
+#define SPI_USER2_REG     (SPI_BASE_REG + 0x20)
+#else
+#define SPI_USER_REG      (SPI_BASE_REG + 0x1C)
+#define SPI_USER1_REG     (SPI_BASE_REG + 0x20)
+#define SPI_USER2_REG     (SPI_BASE_REG + 0x24)
+#endif
+#define SPI_USR_COMMAND   (1<<31)
+#define SPI_USR_ADDR      (1<<30)
+#define SPI_USR_DUMMY     (1<<29)
+#define SPI_USR_MISO      (1<<28)
+#define SPI_USR_MOSI      (1<<27)
+#define SPI_FWRITE_MODE_M (0xF<<12) /* dual/quad/DIO/QIO data phases, for SPI_FLASH_PP */
+#define SPI_USR_ADDR_BITLEN_S    26 /* in SPI_USER1_REG, 6 bits */
+#define SPI_USR_ADDR_BITLEN_M    (0x3F << SPI_USR_ADDR_BITLEN_S)
+#define SPI_USR_COMMAND_BITLEN_S 28 /* in SPI_USER2_REG, value in low 16 bits */
+
 #if defined(ESP32S2) || defined(ESP32S3) || defined(ESP32C3)
 #define SPI_RD_STATUS_REG (SPI_BASE_REG + 0x2C)
 #else
@@ -152,6 +248,7 @@
 #if defined(ESP32S2) || defined(ESP32S3) || defined(ESP32C3)
 #define SPI_W0_REG        (SPI_BASE_REG + 0x58)
 #endif
+#define SPI_W_NUM         16 /* W0..W15 data buffer, 64 bytes */
 
 #if defined(ESP32S2) || defined(ESP32S3) || defined(ESP32C3)
 #define SPI_EXT2_REG      (SPI_BASE_REG + 0x54) /* renamed SPI_MEM_FSM_REG */
@@ -161,6 +258,10 @@
 
 #define SPI_ST 0x7 /* done state value */
 
+#if defined(ESP32) || defined(ESP32S2) || defined(ESP32S3) || defined(ESP32C3)
+#define SPI0_CTRL_REG     (SPI0_BASE_REG + 0x08)
+#endif
+
 #ifdef ESP32
 /* On ESP32 & newer the SPI peripherals are layered
  * flash, this lets us check the state of the internal
@@ -192,6 +293,26 @@
 #define USB_GLBLLNTRMSK    (1 << 0)
 
 
+/**********************************************************
+ * APP_CPU reset & clock control
+ */
+
+#ifdef ESP32
+#define DPORT_APPCPU_CTRL_A_REG  0x3ff0002c
+#define DPORT_APPCPU_CTRL_B_REG  0x3ff00030
+#define DPORT_APPCPU_CTRL_C_REG  0x3ff00034
+#define DPORT_APPCPU_RESETTING   (1 << 0) /* in CTRL_A */
+#define DPORT_APPCPU_CLKGATE_EN  (1 << 0) /* in CTRL_B */
+#define DPORT_APPCPU_RUNSTALL    (1 << 0) /* in CTRL_C */
+#endif // ESP32
+
+#ifdef ESP32S3
+#define SYSTEM_CORE_1_CONTROL_0_REG      0x600c0000
+#define SYSTEM_CONTROL_CORE_1_RUNSTALL   (1 << 0)
+#define SYSTEM_CONTROL_CORE_1_CLKGATE_EN (1 << 1)
+#define SYSTEM_CONTROL_CORE_1_RESETING   (1 << 2)
+#endif // ESP32S3
+
 /**********************************************************
  * RTC_CNTL peripheral
  */
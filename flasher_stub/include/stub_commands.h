@@ -25,20 +25,65 @@
 #include "stub_flasher.h"
 #include <stdbool.h>
 
-int handle_flash_erase(uint32_t addr, uint32_t len);
-
 void handle_flash_read(uint32_t addr, uint32_t len, uint32_t block_size, uint32_t max_in_flight);
 
+/* Same as handle_flash_read(), but sends a raw deflate stream of the
+   flash contents. block_size and acks count compressed bytes, the final
+   MD5 is of the uncompressed data. */
+void handle_flash_read_deflated(uint32_t addr, uint32_t len, uint32_t block_size, uint32_t max_in_flight);
+
 int handle_flash_get_md5sum(uint32_t addr, uint32_t len);
 
+/* Sends an MD5 digest for each of num_regions (addr, len) pairs in regions */
+int handle_flash_get_md5sums(uint32_t *regions, uint32_t num_regions);
+
+/* Sends a digest of the region: SHA-256 computed by the SHA peripheral
+   on ESP32 and later, MD5 on ESP8266 */
+#if ESP32_OR_LATER
+#define FLASH_DIGEST_LEN 32
+#else
+#define FLASH_DIGEST_LEN 16
+#endif
+int handle_flash_get_digest(uint32_t addr, uint32_t len);
+
+/* Sends one MD5 digest for each sector_size (FLASH_SECTOR_SIZE or
+   FLASH_BLOCK_SIZE) chunk of the region. Last chunk may be shorter.
+   Returns ESP_BAD_DATA_LEN for more than SECTOR_MD5_MAX_SECTORS chunks,
+   as the response length wouldn't fit its 16 bits. */
+#define SECTOR_MD5_MAX_SECTORS ((0xFFFF - 2) / 16)
+uint32_t sector_md5_count(uint32_t len, uint32_t sector_size);
+int handle_flash_get_sector_md5sums(uint32_t addr, uint32_t len, uint32_t sector_size);
+
 int handle_flash_read_chip_id();
 
 esp_command_error handle_spi_set_params(uint32_t *args, int *status);
 
 esp_command_error handle_spi_attach(uint32_t hspi_config_arg);
 
+/* Choose the SPI read mode (ROM SpiFlashRdMode value: 2 DIO, 3 DOUT,
+   4 FASTRD) and clock divider (0 to keep the current clock, at most
+   SPI_CLK_DIV_MAX) used while reading flash for READ_FLASH & the verify
+   commands. Any other mode goes back to always using the attach settings.
+
+   QIO & QOUT (0, 1) fail with ESP_FAILED_SPI_OP, as the ROM would set the
+   QE bit in the flash status register for them. */
+esp_command_error handle_spi_set_read_mode(uint32_t mode, uint32_t clk_div);
+
+/* Switch to/from the read mode set by handle_spi_set_read_mode(). Writes &
+   erases always use the settings made by attach/SPI_SET_PARAMS. */
+void spi_fast_read_begin(void);
+void spi_fast_read_end(void);
+
+/* Returns ESP_BAD_ADDRESS if the region overlaps the stub's own code,
+   data or receive buffers */
 esp_command_error handle_mem_begin(uint32_t size, uint32_t offset);
 
 esp_command_error handle_mem_data(void *data, uint32_t length);
 
 esp_command_error handle_mem_finish(void);
+
+/* Send the stub_stats_t counters as response data, then reset them */
+int handle_get_stats(void);
+
+/* Runs the ESP_BAUD_TEST exchange, once the first response has been sent */
+void handle_baud_test(uint32_t test_baud, uint32_t current_baud, uint32_t len);
@@ -21,7 +21,10 @@
 
 #include <stdint.h>
 
-/* Maximum write block size, used for various buffers. */
+/* Write block size which every chip supports (the default used by esptool.py).
+
+   The receive buffers are sized per chip in ld/stub_*.ld, and some chips
+   accept bigger blocks - see ESP_GET_MAX_BLOCK_SIZE. */
 #define MAX_WRITE_BLOCK 0x4000
 
 /* Flash geometry constants */
@@ -30,6 +33,8 @@
 #define FLASH_PAGE_SIZE 256
 #define FLASH_STATUS_MASK 0xFFFF
 #define SECTORS_PER_BLOCK (FLASH_BLOCK_SIZE / FLASH_SECTOR_SIZE)
+#define FLASH_HALF_BLOCK_SIZE 32768
+#define SECTORS_PER_HALF_BLOCK (FLASH_HALF_BLOCK_SIZE / FLASH_SECTOR_SIZE)
 
 /* Full set of protocol commands */
 typedef enum {
@@ -63,8 +68,69 @@ typedef enum {
 
   /* Flash encryption debug mode supported command */
   ESP_FLASH_ENCRYPT_DATA = 0xD4,
+
+  /* Stub-only commands, continued */
+  ESP_FLASH_SECTOR_MD5 = 0xD5,
+  ESP_READ_FLASH_DEFLATED = 0xD6,
+  ESP_GET_MAX_BLOCK_SIZE = 0xD7, /* max block_size for FLASH_BEGIN & co, returned as response value */
+  ESP_SET_RX_WINDOW = 0xD8, /* arg is max block_size, response value is how many data blocks can be in flight */
+  ESP_FLASH_VERIFY_DIGEST = 0xD9, /* like FLASH_VERIFY_MD5, SHA-256 where supported. Response value is digest length */
+  ESP_FLASH_MULTI_MD5 = 0xDA, /* params are any number of (addr, len) pairs */
+  ESP_SPI_SET_READ_MODE = 0xDB, /* params are read mode, clock divider */
+  ESP_ERASE_STATUS = 0xDC, /* response value is sectors left to erase, 0 when done */
+  ESP_GET_STATS = 0xDD, /* response data is stub_stats_t, counters are reset afterwards */
+  ESP_FLASH_LZ4_BEGIN = 0xDE, /* same parameters as ESP_FLASH_DEFLATED_BEGIN */
+  ESP_FLASH_LZ4_DATA = 0xDF,
+  ESP_FLASH_LZ4_END = 0xE0,
+  ESP_MEM_DEFLATED_BEGIN = 0xE1, /* same parameters as ESP_MEM_BEGIN, finish with ESP_MEM_END */
+  ESP_MEM_DEFLATED_DATA = 0xE2,
+  ESP_BAUD_TEST = 0xE3, /* params are test baud rate, current baud rate, pattern length. See baud_test_result_t */
+  ESP_FLASH_SEGMENTS_BEGIN = 0xE4, /* one session writing several regions, see FLASH_MAX_SEGMENTS */
+  ESP_FLASH_COPY = 0xE5, /* params are src, dst, len. Response data is the MD5 of dst, as for FLASH_VERIFY_MD5 */
+  ESP_FLASH_FILL = 0xE6, /* params are dst, len, then the pattern. Response data is the MD5 of dst */
 } esp_command;
 
+/* Optional flags word passed after the 4 parameters of
+   ESP_FLASH_BEGIN / ESP_FLASH_DEFLATED_BEGIN (stub only) / ESP_FLASH_LZ4_BEGIN */
+#define FLASH_BEGIN_SKIP_ERASED  (1 << 0) /* Read back each sector/block before erasing it, skip erase if already all 0xFF */
+#define FLASH_BEGIN_ENCRYPT      (1 << 1) /* Write all data in the session with flash encryption, like ESP_FLASH_ENCRYPT_DATA (not ESP8266) */
+
+/* Offset and size of a FLASH_BEGIN_ENCRYPT write have to be multiples of this */
+#define FLASH_ENCRYPT_ALIGN 32
+
+/* ESP_FLASH_SEGMENTS_BEGIN takes a codec, the compressed size (as for
+   ESP_FLASH_DEFLATED_BEGIN), block_size and flags, then an (offset, size)
+   pair for each of up to FLASH_MAX_SEGMENTS segments, in ascending order
+   and not overlapping. Offsets, and the sizes of all but the last segment,
+   have to be multiples of 4 (ESP_BAD_DATA_LEN otherwise). The data is all the segments one after the other
+   (compressed as one stream), sent with the DATA and END commands for
+   the codec. */
+#define FLASH_MAX_SEGMENTS 16
+#define FLASH_SEGMENTS_PLAIN    0 /* ESP_FLASH_DATA / ESP_FLASH_END */
+#define FLASH_SEGMENTS_DEFLATED 1 /* ESP_FLASH_DEFLATED_DATA / ESP_FLASH_DEFLATED_END */
+#define FLASH_SEGMENTS_LZ4      2 /* ESP_FLASH_LZ4_DATA / ESP_FLASH_LZ4_END */
+
+/* ESP_FLASH_LZ4_DATA payloads are a stream of LZ4 blocks, as in the data
+   blocks of the LZ4 frame format: each one is prefixed by its size as a
+   little-endian word, with FLASH_LZ4_STORED set if the block is stored
+   uncompressed, and a size word of 0 ends the stream.
+
+   Blocks have to be independent (no matches into the previous block), and
+   each decompresses to at most FLASH_LZ4_MAX_BLOCK_SIZE bytes. */
+#define FLASH_LZ4_STORED  (1U << 31)
+#define FLASH_LZ4_MAX_BLOCK_SIZE 0x4000
+
+/* ESP_FLASH_COPY & ESP_FLASH_FILL run entirely on the chip, writing like a
+   flashing session (and ending any current one): every sector the
+   destination touches is erased. Addresses have to be word aligned, copy
+   source & destination must not overlap, and a fill pattern is 1 to
+   FLASH_FILL_MAX_PATTERN bytes repeated over the region. */
+#define FLASH_FILL_MAX_PATTERN 256
+
+/* Optional flags word passed after the parameters of
+   ESP_ERASE_FLASH / ESP_ERASE_REGION (stub only) */
+#define ERASE_ASYNC  (1 << 0) /* Respond immediately and erase in the background, see ESP_ERASE_STATUS */
+
 /* Command request header */
 typedef struct __attribute__((packed)) {
   uint8_t zero;
@@ -91,6 +157,29 @@ typedef struct __attribute__((packed)) {
   uint8_t status; /* status of a failure */
 } esp_command_data_status_t;
 
+/* ESP_BAUD_TEST: after the (normal) response, the stub switches to the
+   test baud rate and waits for the host to send the test pattern as one
+   SLIP frame. It then sends a second ESP_BAUD_TEST response (at the test
+   rate) with one of these as the data and bit_errors as the value,
+   followed by the pattern as a SLIP frame of its own for the host to
+   check. Then it goes back to the current baud rate, use ESP_SET_BAUD to
+   actually change it.
+
+   Like ESP_SET_BAUD, each change happens 10ms after the stub has sent
+   what comes before it. Pattern byte i is the low byte of the (i+1)th
+   xorshift32 (13, 17, 5) output, starting from BAUD_TEST_SEED.
+*/
+#define BAUD_TEST_SEED 0x2545F491
+
+typedef struct __attribute__((packed)) {
+  uint32_t bytes_received;   /* length of the pattern frame, 0 if none arrived */
+  uint32_t bit_errors;       /* bits which differ from the pattern, 8 per missing or extra byte */
+  uint32_t rx_fifo_overruns;
+  uint32_t slip_errors;
+  uint32_t rx_us;            /* from the first byte of the frame to the last */
+  uint32_t rx_bytes_per_s;   /* bytes on the wire (SLIP encoded) per second */
+} baud_test_result_t;
+
 /* Error codes */
 typedef enum {
   ESP_OK = 0,
@@ -105,8 +194,25 @@ typedef enum {
   ESP_INFLATE_ERROR = 0xC7,
   ESP_NOT_ENOUGH_DATA = 0xC8,
   ESP_TOO_MUCH_DATA = 0xC9,
+  ESP_BAD_ADDRESS = 0xCA,
+  ESP_BAD_SEQUENCE = 0xCB,
+  ESP_IN_FLASH_MODE = 0xCC, /* command would end a flashing session in progress */
 
   ESP_CMD_NOT_IMPLEMENTED = 0xFF,
 } esp_command_error;
 
+/* Returns the next complete frame received by the interrupt-driven RX path,
+   or NULL if none has arrived yet. Sets *len to the length of the frame.
+   The frame stays valid until the next call, which frees its buffer.
+
+   Implemented in stub_flasher.c. Frames received while a command is
+   running are not commands, ie read_flash acks.
+*/
+uint8_t *stub_rx_next_frame(uint32_t *len);
+
+/* Drops every frame received so far, including the one being held and
+   any partial frame, and starts SLIP decoding afresh. For when what was
+   received can't be trusted, ie at the wrong baud rate. */
+void stub_rx_reset(void);
+
 #endif /* STUB_FLASHER_H_ */
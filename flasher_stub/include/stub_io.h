@@ -22,29 +22,42 @@
 #include <stdbool.h>
 
 /* Call to initialize the I/O (either UART or USB CDC at this point).
- * The argument is a callback function which will handle received characters,
- * when asynchronous (interrupt-driven) RX is used.
+ * The argument is a callback function which will handle received characters
+ * when asynchronous (interrupt-driven) RX is used, a UART FIFO's worth or
+ * a USB packet at a time.
  * It will be called in an interrupt context.
  */
-void stub_io_init(void(*rx_cb_func)(char));
+void stub_io_init(void(*rx_buf_cb_func)(const uint8_t *, uint32_t));
 
 /* Enable or disable asynchronous (interrupt-driven) RX, for UART or USB.
- * Currently needed only for the read_flash command.
  */
 void stub_rx_async_enable(bool enable);
 
-/* Wrapper for either uart_tx_one_char or the USB CDC output function.
+/* Queue output for either the UART or the USB CDC output function.
+ * UART output goes via a ring buffer which is drained into the TX FIFO
+ * from the UART interrupt, so this usually returns without waiting for
+ * the data to be sent. USB output is buffered until there are several
+ * packets of it, or until stub_tx_push() / stub_io_idle_hook() / stub_tx_flush().
  * (uart_tx_one_char in ROM can also handle USB CDC, but it is really
  * slow because it flushes the FIFO after every byte).
  */
+void stub_tx_buf(const void *buf, uint32_t len);
+
+/* Same as stub_tx_buf() for a single character */
 void stub_tx_one_char(char c);
 
 /* A blocking (polling) function to receive one character.
  * Should only be used when async (interrupt-driven) RX is disabled.
- * Currently only needed for the read_flash command.
  */
 char stub_rx_one_char(void);
 
+/* Start sending everything queued so far, without waiting for it to go.
+ * UART output is sent in the background anyway, USB output sitting in the
+ * packet buffer is handed to the CDC driver. For the end of a response the
+ * host waits for, bulk data is better left to fill whole packets.
+ */
+void stub_tx_push(void);
+
 /* Returns after making sure that all output has been sent to the host */
 void stub_tx_flush(void);
 
@@ -55,7 +68,7 @@ void stub_tx_flush(void);
 void stub_io_set_baudrate(uint32_t current_baud, uint32_t new_baud);
 
 /* To be called periodically while waiting for a command.
- * No-op for UART, handles DTR/RTS reset for USB CDC.
+ * Pushes out any queued UART or USB output, handles DTR/RTS reset for USB CDC.
  */
 void stub_io_idle_hook(void);
 
@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2016-2019 Espressif Systems (Shanghai) PTE LTD
+ * All rights reserved
+ *
+ * This file is part of the esptool.py binary flasher stub.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51 Franklin
+ * Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Performance counters, sent to the host by ESP_GET_STATS */
+#pragma once
+#include <stdint.h>
+
+/* Layout is sent as-is in the ESP_GET_STATS response, only add fields at the end.
+   Cycle counts are CPU cycles, at cpu_freq_mhz. Each phase is counted on
+   its own, ie cycles_rx doesn't include cycles_checksum. */
+typedef struct {
+  uint32_t cpu_freq_mhz;
+  uint32_t bytes_in;         /* raw bytes received, before SLIP decoding */
+  uint32_t bytes_out;        /* raw bytes sent, after SLIP encoding */
+  uint32_t rx_fifo_overruns; /* times the UART RX FIFO overflowed and lost data */
+  uint32_t slip_errors;      /* invalid SLIP escape sequences */
+  uint32_t rx_frames_dropped; /* frames overwritten because the host overran the RX window */
+  uint64_t cycles_rx;        /* receive interrupt, SLIP decoding into the RX slots */
+  uint64_t cycles_checksum;  /* data checksum, during receive or in cmd_loop() */
+  uint64_t cycles_inflate;   /* tinfl_decompress() */
+  uint64_t cycles_erase_wait; /* waiting for erases to catch up with the data to write */
+  uint64_t cycles_flash_write; /* page programming, or ROM SPIWrite() */
+} stub_stats_t;
+
+extern stub_stats_t stub_stats;
+
+/* Free-running CPU cycle counter */
+#ifdef STUB_BENCH
+uint32_t bench_ccount(void);
+#endif
+static inline uint32_t stub_ccount(void)
+{
+  uint32_t r;
+#if defined(STUB_BENCH)
+  r = bench_ccount();
+#elif defined(ESP32C3)
+  __asm__ __volatile__("csrr %0, 0x7e2" : "=r"(r)); /* mpccr */
+#else
+  __asm__ __volatile__("rsr %0, ccount" : "=a"(r));
+#endif
+  return r;
+}
+
+/* Start the cycle counter, if it needs starting */
+static inline void stub_stats_init(void)
+{
+#ifdef ESP32C3
+  __asm__ __volatile__("csrw 0x7e0, %0" :: "r"(1)); /* mpcer: count cycles */
+  __asm__ __volatile__("csrw 0x7e1, %0" :: "r"(1)); /* mpcmr: enable counter */
+#endif
+}
@@ -26,9 +26,22 @@ bool is_in_flash_mode(void);
 
 esp_command_error get_flash_error(void);
 
-esp_command_error handle_flash_begin(uint32_t total_size, uint32_t offset);
+/* 'flags' is a combination of FLASH_BEGIN_xxx values */
+esp_command_error handle_flash_begin(uint32_t total_size, uint32_t offset, uint32_t flags);
 
-esp_command_error handle_flash_deflated_begin(uint32_t uncompressed_size, uint32_t compressed_size, uint32_t offset);
+esp_command_error handle_flash_deflated_begin(uint32_t uncompressed_size, uint32_t compressed_size, uint32_t offset, uint32_t flags);
+
+esp_command_error handle_flash_lz4_begin(uint32_t uncompressed_size, uint32_t offset, uint32_t flags);
+
+/* 'segments' is num_segments (offset, size) pairs, see FLASH_MAX_SEGMENTS */
+esp_command_error handle_flash_segments_begin(uint32_t codec, uint32_t compressed_size, uint32_t flags,
+                                              const uint32_t *segments, uint32_t num_segments);
+
+/* Returns ESP_BAD_SEQUENCE unless seq is the next data block's sequence
+   number in this session (from 0), so a block lost to a receive window
+   overrun fails the ones after it rather than shifting them in flash.
+   Moves on to the next number if it is. */
+esp_command_error flash_data_check_seq(uint32_t seq);
 
 void handle_flash_data(void *data_buf, uint32_t length);
 
@@ -38,6 +51,49 @@ void handle_flash_encrypt_data(void *data_buf, uint32_t length);
 
 void handle_flash_deflated_data(void *data_buf, uint32_t length);
 
+/* payload format is described at FLASH_LZ4_STORED */
+void handle_flash_lz4_data(void *data_buf, uint32_t length);
+
+/* Deflated RAM load, into the region set up by handle_mem_begin().
+   Shares the inflator with deflated flash writes, so begin is refused
+   with ESP_IN_FLASH_MODE while a flash write session is open. */
+esp_command_error handle_mem_deflated_begin(void);
+esp_command_error handle_mem_deflated_data(void *data_buf, uint32_t length);
+
+/* To be called periodically while waiting for a command.
+   Erases ahead of the current write position if a flashing session is active.
+   Never blocks waiting for the flash chip.
+*/
+void stub_flash_idle_hook(void);
+
+/* Erase a sector aligned region, waits until the erase is finished */
+esp_command_error handle_flash_erase(uint32_t addr, uint32_t len);
+
+/* Start erasing in the background, from stub_flash_idle_hook().
+   Only valid outside of a flashing session, ESP_IN_FLASH_MODE otherwise. */
+esp_command_error handle_flash_erase_async(uint32_t addr, uint32_t len);
+esp_command_error handle_flash_erase_chip_async(void);
+
+/* Number of sectors a background erase still has to erase, plus one
+   while the flash chip is busy. 0 once everything is finished. */
+uint32_t get_flash_erase_remaining(void);
+
+/* Block until any background erase is finished. Call before anything
+   else uses the flash. Does nothing during a flashing session. */
+void flash_erase_wait(void);
+
+/* See ESP_FLASH_COPY & ESP_FLASH_FILL. Both return once the last of the
+   data is written, the host gets the MD5 of the destination afterwards.
+   ESP_IN_FLASH_MODE if a flashing session is open, as they run their own. */
+esp_command_error handle_flash_copy(uint32_t src, uint32_t dst, uint32_t len);
+esp_command_error handle_flash_fill(uint32_t dst, uint32_t len, const uint8_t *pattern, uint32_t pattern_len);
+
+/* On dual core chips, start the APP_CPU running write-behind for
+   compressed writes (see STUB_DUAL_CORE). Stop it again before leaving
+   the stub. Both do nothing on single core chips. */
+void flash_worker_start(void);
+void flash_worker_stop(void);
+
 /* same command used for deflated or non-deflated mode */
 esp_command_error handle_flash_end(void);
 
@@ -18,6 +18,7 @@
 #include <stdint.h>
 #include "slip.h"
 #include "stub_io.h"
+#include "stub_stats.h"
 
 void SLIP_send_frame_delimiter(void) {
   stub_tx_one_char('\xc0');
@@ -37,9 +38,16 @@ void SLIP_send_frame_data(char ch) {
 
 void SLIP_send_frame_data_buf(const void *buf, uint32_t size) {
   const uint8_t *buf_c = (const uint8_t *)buf;
+  uint32_t run_start = 0;
+  /* Pass each run of bytes which need no escaping to the output in one go */
   for(int i = 0; i < size; i++) {
-	SLIP_send_frame_data(buf_c[i]);
+	if (buf_c[i] == 0xc0 || buf_c[i] == 0xdb) {
+	  stub_tx_buf(buf_c + run_start, i - run_start);
+	  SLIP_send_frame_data(buf_c[i]);
+	  run_start = i + 1;
+	}
   }
+  stub_tx_buf(buf_c + run_start, size - run_start);
 }
 
 void SLIP_send(const void *pkt, uint32_t size) {
@@ -78,13 +86,46 @@ int16_t SLIP_recv_byte(char byte, slip_state_t *state)
 	  *state = SLIP_FRAME;
 	  return '\xdb';
 	}
+	stub_stats.slip_errors++;
 	return SLIP_NO_BYTE; /* actually a framing error */
   }
   return SLIP_NO_BYTE; /* actually a framing error */
 }
 
+uint32_t SLIP_recv_buf(const uint8_t *in, uint32_t len, slip_state_t *state,
+                       uint8_t *out, uint32_t *out_len, uint32_t max_len,
+                       bool *finished)
+{
+  uint32_t i = 0;
+  uint32_t n = *out_len;
+
+  *finished = false;
+  while (i < len && !*finished) {
+	if (*state == SLIP_FRAME) {
+	  /* Copy the run up to the next delimiter or escape in one go */
+	  while (i < len && n < max_len && in[i] != 0xc0 && in[i] != 0xdb) {
+		out[n++] = in[i++];
+	  }
+	  if (n == max_len) {
+		*finished = true;
+		break;
+	  }
+	  if (i == len) {
+		break;
+	  }
+	}
+	int16_t r = SLIP_recv_byte(in[i++], state);
+	if (r >= 0) {
+	  out[n++] = (uint8_t)r;
+	}
+	*finished = (r == SLIP_FINISHED_FRAME || n == max_len);
+  }
+  *out_len = n;
+  return i;
+}
+
 /* This function is needed for the synchornous I/O case,
- * which is only flash_read command at the moment.
+ * ie when async RX has been disabled.
  */
 uint32_t SLIP_recv(void *pkt, uint32_t max_len) {
   uint32_t len = 0;
@@ -21,31 +21,25 @@
 #include "slip.h"
 #include "soc_support.h"
 #include "stub_io.h"
+#include "stub_stats.h"
 
-int handle_flash_erase(uint32_t addr, uint32_t len) {
-  if (addr % FLASH_SECTOR_SIZE != 0) return 0x32;
-  if (len % FLASH_SECTOR_SIZE != 0) return 0x33;
-  if (SPIUnlock() != 0) return 0x34;
-
-  while (len > 0 && (addr % FLASH_BLOCK_SIZE != 0)) {
-    if (SPIEraseSector(addr / FLASH_SECTOR_SIZE) != 0) return 0x35;
-    len -= FLASH_SECTOR_SIZE;
-    addr += FLASH_SECTOR_SIZE;
+/* Check for a read_flash ack from the host, updating *num_acked if one
+   has arrived. Returns false if the host sent something that isn't an ack. */
+static bool poll_flash_read_ack(uint32_t *num_acked)
+{
+  uint32_t frame_len;
+  uint8_t *frame = stub_rx_next_frame(&frame_len);
+  if (frame == NULL) {
+    stub_io_idle_hook();
+    return true;
   }
-
-  while (len > FLASH_BLOCK_SIZE) {
-    if (SPIEraseBlock(addr / FLASH_BLOCK_SIZE) != 0) return 0x36;
-    len -= FLASH_BLOCK_SIZE;
-    addr += FLASH_BLOCK_SIZE;
+  if (frame_len != sizeof(*num_acked)) {
+    return false;
   }
-
-  while (len > 0) {
-    if (SPIEraseSector(addr / FLASH_SECTOR_SIZE) != 0) return 0x37;
-    len -= FLASH_SECTOR_SIZE;
-    addr += FLASH_SECTOR_SIZE;
-  }
-
-  return 0;
+  /* Acks are cumulative, so it doesn't matter if
+     an earlier one was overwritten before we got here */
+  *num_acked = *(uint32_t *)frame;
+  return true;
 }
 
 void handle_flash_read(uint32_t addr, uint32_t len, uint32_t block_size,
@@ -54,42 +48,260 @@ void handle_flash_read(uint32_t addr, uint32_t len, uint32_t block_size,
   uint8_t digest[16];
   struct MD5Context ctx;
   uint32_t num_sent = 0, num_acked = 0;
+  bool read_error = false;
 
-  /* This is one routine where we still do synchronous I/O */
-  stub_rx_async_enable(false);
-
-  if (block_size > sizeof(buf)) {
+  if (block_size == 0) {
     return;
   }
+
+  /* Acks arrive via the normal async RX path, and the UART sends each
+     block from its TX buffer while the next one is read & hashed. */
   MD5Init(&ctx);
-  while (num_acked < len && num_acked <= num_sent) {
-    while (num_sent < len && num_sent - num_acked < max_in_flight) {
+  while (num_acked < len && num_acked <= num_sent && !read_error) {
+    while (num_sent < len && num_sent - num_acked < max_in_flight && !read_error) {
       uint32_t n = len - num_sent;
       if (n > block_size) n = block_size;
-      if (SPIRead(addr, (uint32_t *)buf, n) != 0) {
-        break;
+      /* Blocks bigger than buf are read & sent in chunks, as one frame */
+      SLIP_send_frame_delimiter();
+      while (n > 0) {
+        uint32_t chunk = n < sizeof(buf) ? n : sizeof(buf);
+        if (SPIRead(addr, (uint32_t *)buf, chunk) != 0) {
+          read_error = true;
+          break;
+        }
+        SLIP_send_frame_data_buf(buf, chunk);
+        MD5Update(&ctx, buf, chunk);
+        addr += chunk;
+        num_sent += chunk;
+        n -= chunk;
       }
-      SLIP_send(buf, n);
-      MD5Update(&ctx, buf, n);
-      addr += n;
-      num_sent += n;
+      SLIP_send_frame_delimiter();
     }
-    int r = SLIP_recv(&num_acked, sizeof(num_acked));
-    if (r != 4) {
+    if (!poll_flash_read_ack(&num_acked)) {
       break;
     }
   }
   MD5Final(digest, &ctx);
   SLIP_send(digest, sizeof(digest));
+}
 
-  /* Go back to async RX */
-  stub_rx_async_enable(true);
+/* Minimal raw deflate (RFC1951) encoder for handle_flash_read_deflated().
+
+   Uses the fixed Huffman codes and a greedy, single probe LZ77 match
+   search within each FLASH_SECTOR_SIZE chunk. That is nowhere near
+   zlib's compression ratio, but erased or zeroed flash (where nearly all
+   of the gain is when dumping a chip) still shrinks ~100x, and it needs
+   very little code and RAM compared to tdefl.
+*/
+#define DEFLATE_HASH_BITS 9
+#define DEFLATE_MAX_MATCH 258
+
+typedef struct {
+  uint32_t bit_buf;
+  uint32_t bit_count;
+  uint8_t out[64];
+  uint32_t out_len;
+  /* compressed stream is sent with the same windowed acks as read_flash */
+  uint32_t block_size;
+  uint32_t max_in_flight;
+  uint32_t frame_len; /* bytes sent so far in the current SLIP frame */
+  uint32_t num_sent;
+  uint32_t num_acked;
+  bool failed;
+} deflate_out_t;
+
+static void deflate_send(deflate_out_t *d)
+{
+  uint8_t *p = d->out;
+  uint32_t len = d->out_len;
+
+  while (len > 0 && !d->failed) {
+    if (d->frame_len == 0) {
+      /* starting a new frame, wait for room in the host's window */
+      while (d->num_sent - d->num_acked >= d->max_in_flight) {
+        if (!poll_flash_read_ack(&d->num_acked)) {
+          d->failed = true;
+          return;
+        }
+      }
+      SLIP_send_frame_delimiter();
+    }
+    uint32_t n = d->block_size - d->frame_len;
+    if (n > len) {
+      n = len;
+    }
+    SLIP_send_frame_data_buf(p, n);
+    p += n;
+    len -= n;
+    d->frame_len += n;
+    d->num_sent += n;
+    if (d->frame_len == d->block_size) {
+      SLIP_send_frame_delimiter();
+      d->frame_len = 0;
+    }
+  }
+  d->out_len = 0;
 }
 
-int handle_flash_get_md5sum(uint32_t addr, uint32_t len) {
+/* Bits are packed starting from the least significant bit of each byte.
+   n can be at most 24. */
+static void deflate_put_bits(deflate_out_t *d, uint32_t bits, uint32_t n)
+{
+  d->bit_buf |= bits << d->bit_count;
+  d->bit_count += n;
+  while (d->bit_count >= 8) {
+    d->out[d->out_len++] = d->bit_buf & 0xff;
+    d->bit_buf >>= 8;
+    d->bit_count -= 8;
+    if (d->out_len == sizeof(d->out)) {
+      deflate_send(d);
+    }
+  }
+}
+
+/* Huffman codes are sent most significant bit first */
+static void deflate_put_code(deflate_out_t *d, uint32_t code, uint32_t n)
+{
+  uint32_t reversed = 0;
+  for (int i = 0; i < n; i++) {
+    reversed = (reversed << 1) | (code & 1);
+    code >>= 1;
+  }
+  deflate_put_bits(d, reversed, n);
+}
+
+/* Send a literal/length symbol using the fixed Huffman code */
+static void deflate_put_symbol(deflate_out_t *d, uint32_t sym)
+{
+  if (sym < 144) {
+    deflate_put_code(d, 0x30 + sym, 8);
+  } else if (sym < 256) {
+    deflate_put_code(d, 0x190 + sym - 144, 9);
+  } else if (sym < 280) {
+    deflate_put_code(d, sym - 256, 7);
+  } else {
+    deflate_put_code(d, 0xc0 + sym - 280, 8);
+  }
+}
+
+static uint32_t log2_floor(uint32_t v)
+{
+  uint32_t r = 0;
+  while (v >>= 1) {
+    r++;
+  }
+  return r;
+}
+
+static void deflate_put_match(deflate_out_t *d, uint32_t len, uint32_t dist)
+{
+  /* length codes 257..285, each covering a power of 2 range of lengths */
+  uint32_t v = len - 3;
+  if (len == DEFLATE_MAX_MATCH) {
+    deflate_put_symbol(d, 285);
+  } else if (v < 8) {
+    deflate_put_symbol(d, 257 + v);
+  } else {
+    uint32_t extra = log2_floor(v) - 2;
+    deflate_put_symbol(d, 257 + 4 * (extra + 1) + ((v >> extra) & 3));
+    deflate_put_bits(d, v & ((1 << extra) - 1), extra);
+  }
+
+  /* distance codes 0..29, same idea with 2 codes per power of 2 */
+  v = dist - 1;
+  if (v < 4) {
+    deflate_put_code(d, v, 5);
+  } else {
+    uint32_t extra = log2_floor(v) - 1;
+    deflate_put_code(d, 2 * (extra + 1) + ((v >> extra) & 1), 5);
+    deflate_put_bits(d, v & ((1 << extra) - 1), extra);
+  }
+}
+
+/* Compress 'len' bytes of 'buf' as a single fixed Huffman block */
+static void deflate_compress_block(deflate_out_t *d, const uint8_t *buf, uint32_t len, bool final)
+{
+  uint16_t head[1 << DEFLATE_HASH_BITS]; /* position + 1 of the last occurrence of each hash, 0 if none */
+  for (int i = 0; i < sizeof(head) / sizeof(head[0]); i++) {
+    head[i] = 0;
+  }
+
+  deflate_put_bits(d, final ? 1 : 0, 1); /* BFINAL */
+  deflate_put_bits(d, 1, 2); /* BTYPE = fixed Huffman codes */
+
+  uint32_t i = 0;
+  while (i < len) {
+    uint32_t match_len = 0;
+    uint32_t match_pos = 0;
+    if (i + 3 <= len) {
+      uint32_t h = ((buf[i] << 16) | (buf[i + 1] << 8) | buf[i + 2]) * 2654435761U;
+      h >>= 32 - DEFLATE_HASH_BITS;
+      if (head[h] != 0) {
+        uint32_t max_len = len - i;
+        if (max_len > DEFLATE_MAX_MATCH) {
+          max_len = DEFLATE_MAX_MATCH;
+        }
+        match_pos = head[h] - 1;
+        while (match_len < max_len && buf[match_pos + match_len] == buf[i + match_len]) {
+          match_len++;
+        }
+      }
+      head[h] = i + 1;
+    }
+    if (match_len >= 3) {
+      deflate_put_match(d, match_len, i - match_pos);
+      i += match_len;
+    } else {
+      deflate_put_symbol(d, buf[i]);
+      i++;
+    }
+  }
+  deflate_put_symbol(d, 256); /* end of block */
+}
+
+void handle_flash_read_deflated(uint32_t addr, uint32_t len, uint32_t block_size,
+                                uint32_t max_in_flight) {
   uint8_t buf[FLASH_SECTOR_SIZE];
   uint8_t digest[16];
   struct MD5Context ctx;
+  deflate_out_t d = {
+    .block_size = block_size,
+    .max_in_flight = max_in_flight,
+  };
+
+  if (block_size == 0) {
+    return;
+  }
+
+  MD5Init(&ctx);
+  do {
+    uint32_t n = len < sizeof(buf) ? len : sizeof(buf);
+    if (n > 0 && SPIRead(addr, (uint32_t *)buf, n) != 0) {
+      break; /* host will find the stream is truncated */
+    }
+    MD5Update(&ctx, buf, n);
+    addr += n;
+    len -= n;
+    deflate_compress_block(&d, buf, n, len == 0);
+  } while (len > 0 && !d.failed);
+
+  /* pad out the last byte, then send whatever is left */
+  deflate_put_bits(&d, 0, 7);
+  deflate_send(&d);
+  if (d.frame_len > 0) {
+    SLIP_send_frame_delimiter();
+  }
+  while (d.num_acked < d.num_sent && !d.failed) {
+    d.failed = !poll_flash_read_ack(&d.num_acked);
+  }
+
+  MD5Final(digest, &ctx);
+  SLIP_send(digest, sizeof(digest));
+}
+
+static int calculate_flash_md5(uint32_t addr, uint32_t len, uint8_t digest[16]) {
+  uint8_t buf[FLASH_SECTOR_SIZE];
+  struct MD5Context ctx;
   MD5Init(&ctx);
   while (len > 0) {
     uint32_t n = len;
@@ -104,11 +316,110 @@ int handle_flash_get_md5sum(uint32_t addr, uint32_t len) {
     len -= n;
   }
   MD5Final(digest, &ctx);
+  return 0;
+}
+
+int handle_flash_get_md5sum(uint32_t addr, uint32_t len) {
+  uint8_t digest[16];
+  int res = calculate_flash_md5(addr, len, digest);
+  if (res != 0) {
+    return res;
+  }
   /* ESP32 ROM sends as hex, but we just send raw bytes - esptool.py can handle either. */
   SLIP_send_frame_data_buf(digest, sizeof(digest));
   return 0;
 }
 
+int handle_flash_get_md5sums(uint32_t *regions, uint32_t num_regions) {
+  for (int i = 0; i < num_regions; i++) {
+    int res = handle_flash_get_md5sum(regions[2 * i], regions[2 * i + 1]);
+    if (res != 0) {
+      return res;
+    }
+  }
+  return 0;
+}
+
+int handle_flash_get_digest(uint32_t addr, uint32_t len) {
+  uint8_t digest[FLASH_DIGEST_LEN];
+#if ESP32_OR_LATER
+  /* Hashing in the SHA peripheral leaves the CPU almost entirely to SPIRead,
+     which is what takes the time when verifying with MD5 in software */
+  uint8_t buf[FLASH_SECTOR_SIZE];
+  SHA_CTX ctx;
+  int res = 0;
+  ets_sha_enable();
+#if ESP32
+  ets_sha_init(&ctx);
+#else
+  ets_sha_init(&ctx, SHA2_256);
+#endif
+  while (len > 0) {
+    uint32_t n = len;
+    if (n > FLASH_SECTOR_SIZE) {
+      n = FLASH_SECTOR_SIZE;
+    }
+    if (SPIRead(addr, (uint32_t *)buf, n) != 0) {
+      res = 0x63;
+      break;
+    }
+#if ESP32
+    ets_sha_update(&ctx, SHA2_256, buf, n * 8);
+#else
+    ets_sha_update(&ctx, buf, n, false);
+#endif
+    addr += n;
+    len -= n;
+  }
+  if (res == 0) {
+#if ESP32
+    ets_sha_finish(&ctx, SHA2_256, digest);
+#else
+    ets_sha_finish(&ctx, digest);
+#endif
+  }
+  ets_sha_disable();
+#else
+  int res = calculate_flash_md5(addr, len, digest);
+#endif
+  if (res != 0) {
+    return res;
+  }
+  SLIP_send_frame_data_buf(digest, sizeof(digest));
+  return 0;
+}
+
+uint32_t sector_md5_count(uint32_t len, uint32_t sector_size)
+{
+  return len / sector_size + (len % sector_size != 0);
+}
+
+int handle_flash_get_sector_md5sums(uint32_t addr, uint32_t len, uint32_t sector_size) {
+  uint8_t digest[16];
+  if (sector_size != FLASH_SECTOR_SIZE && sector_size != FLASH_BLOCK_SIZE) {
+    return ESP_BAD_BLOCKSIZE;
+  }
+  if (sector_md5_count(len, sector_size) > SECTOR_MD5_MAX_SECTORS) {
+    return ESP_BAD_DATA_LEN;
+  }
+  while (len > 0) {
+    uint32_t n = len;
+    if (n > sector_size) {
+      n = sector_size;
+    }
+    int res = calculate_flash_md5(addr, n, digest);
+    if (res != 0) {
+      return res;
+    }
+    /* Host can't tell digests apart if this frame is cut short, but it
+       will see the error status at the end of the frame */
+    SLIP_send_frame_data_buf(digest, sizeof(digest));
+    addr += n;
+    len -= n;
+  }
+  return 0;
+}
+
 esp_command_error handle_spi_set_params(uint32_t *args, int *status)
 {
   *status = SPIParamCfg(args[0], args[1], args[2], args[3], args[4], args[5]);
@@ -132,11 +443,111 @@ esp_command_error handle_spi_attach(uint32_t hspi_config_arg)
         return ESP_OK; /* neither function/attach command takes an arg */
 }
 
+#define SPI_READ_MODE_QIO    0
+#define SPI_READ_MODE_QOUT   1
+#define SPI_READ_MODE_DIO    2
+#define SPI_READ_MODE_FASTRD 4
+
+/* What SPIReadModeCnfig() & setting the clock change: SPI1's read mode
+   bits, clock and the user command setup they go with, plus (on ESP32 &
+   newer) the read mode bits of SPI0, which the ROM sets to match */
+static const uint32_t fast_read_regs[] = {
+  SPI_CTRL_REG, SPI_CLOCK_REG, SPI_USER_REG, SPI_USER1_REG,
+#ifdef SPI0_CTRL_REG
+  SPI0_CTRL_REG,
+#endif
+};
+#define FAST_READ_NUM_REGS (sizeof(fast_read_regs) / sizeof(fast_read_regs[0]))
+
+static struct {
+  bool enabled;
+  uint32_t mode;
+  uint32_t clk_div;
+  uint32_t saved[FAST_READ_NUM_REGS];
+} fast_read;
+
+esp_command_error handle_spi_set_read_mode(uint32_t mode, uint32_t clk_div)
+{
+  /* For the quad modes the ROM also sets the (nonvolatile) QE bit in
+     the flash chip's status register, which spi_fast_read_end() can't
+     undo */
+  if (clk_div > SPI_CLK_DIV_MAX
+      || mode == SPI_READ_MODE_QIO || mode == SPI_READ_MODE_QOUT) {
+    return ESP_FAILED_SPI_OP;
+  }
+  fast_read.enabled = (mode >= SPI_READ_MODE_DIO && mode <= SPI_READ_MODE_FASTRD);
+  fast_read.mode = mode;
+  fast_read.clk_div = clk_div;
+  return ESP_OK;
+}
+
+void spi_fast_read_begin(void)
+{
+  if (!fast_read.enabled) {
+    return;
+  }
+  for (int i = 0; i < FAST_READ_NUM_REGS; i++) {
+    fast_read.saved[i] = READ_REG(fast_read_regs[i]);
+  }
+  SPIReadModeCnfig(fast_read.mode);
+  if (fast_read.clk_div != 0) {
+#ifdef ESP8266
+    uint32_t n = fast_read.clk_div;
+    if (n == 1) {
+      WRITE_REG(SPI_CLOCK_REG, SPI_CLK_EQU_SYSCLK);
+    } else {
+      WRITE_REG(SPI_CLOCK_REG, ((n - 1) << SPI_CLKCNT_N_S)
+                | ((n / 2 - 1) << SPI_CLKCNT_H_S)
+                | ((n - 1) << SPI_CLKCNT_L_S));
+    }
+#else
+    SPIClkConfig(fast_read.clk_div, 1);
+#endif
+  }
+}
+
+void spi_fast_read_end(void)
+{
+  if (!fast_read.enabled) {
+    return;
+  }
+  for (int i = 0; i < FAST_READ_NUM_REGS; i++) {
+    WRITE_REG(fast_read_regs[i], fast_read.saved[i]);
+  }
+}
+
 static uint32_t *mem_offset;
 static uint32_t mem_remaining;
 
+/* Linker script symbols, the stub's DRAM is .bss, .data then .noinit */
+extern uint8_t _text_start[], _text_end[];
+extern uint32_t _bss_start;
+extern uint8_t _noinit_end[];
+extern uint8_t _rx_buf_start[], _rx_buf_end[];
+
+static bool mem_overlaps(uint32_t addr, uint32_t size, const void *start, const void *end)
+{
+    if (addr < (uint32_t)end && (uint32_t)start < addr + size) {
+        return true;
+    }
+#ifdef SRAM_IRAM_DRAM_OFFSET
+    /* the same RAM seen from the other bus */
+    int32_t alias = ((uint32_t)start >= 0x40000000) ? -SRAM_IRAM_DRAM_OFFSET : SRAM_IRAM_DRAM_OFFSET;
+    return addr < (uint32_t)end + alias && (uint32_t)start + alias < addr + size;
+#else
+    return false;
+#endif
+}
+
 esp_command_error handle_mem_begin(uint32_t size, uint32_t offset)
 {
+    /* loading over the running stub would crash it */
+    if (offset + size < offset
+        || mem_overlaps(offset, size, _text_start, _text_end)
+        || mem_overlaps(offset, size, &_bss_start, _noinit_end)
+        || mem_overlaps(offset, size, _rx_buf_start, _rx_buf_end)) {
+        return ESP_BAD_ADDRESS;
+    }
     mem_offset = (uint32_t *)offset;
     mem_remaining = size;
     return ESP_OK;
@@ -155,10 +566,23 @@ esp_command_error handle_mem_data(void *data, uint32_t length)
         return ESP_BAD_DATA_LEN;
     }
 
-    for(int i = 0; i < length; i+= 4) {
-        *mem_offset++ = *data_words++;
-        mem_remaining -= 4;
+    /* a word at a time (IRAM can't be written otherwise),
+       but four of them per loop */
+    uint32_t *dst = mem_offset;
+    uint32_t *end = dst + length / 4;
+    while (end - dst >= 4) {
+        dst[0] = data_words[0];
+        dst[1] = data_words[1];
+        dst[2] = data_words[2];
+        dst[3] = data_words[3];
+        dst += 4;
+        data_words += 4;
     }
+    while (dst < end) {
+        *dst++ = *data_words++;
+    }
+    mem_offset = dst;
+    mem_remaining -= length;
     return ESP_OK;
 }
 
@@ -169,3 +593,134 @@ esp_command_error handle_mem_finish()
     mem_offset = NULL;
     return res;
 }
+
+/* Give up waiting for the pattern after this long without new input */
+#define BAUD_TEST_FIRST_BYTE_TIMEOUT_MS 1000
+#define BAUD_TEST_IDLE_TIMEOUT_MS 100
+
+static uint8_t baud_test_pattern(uint32_t *x)
+{
+  *x ^= *x << 13;
+  *x ^= *x >> 17;
+  *x ^= *x << 5;
+  return *x;
+}
+
+void handle_baud_test(uint32_t test_baud, uint32_t current_baud, uint32_t len)
+{
+  baud_test_result_t r = { 0 };
+  uint32_t cycles_per_ms = ets_get_cpu_frequency() * 1000;
+  uint32_t overruns = stub_stats.rx_fifo_overruns;
+  uint32_t slip_errors = stub_stats.slip_errors;
+  /* counted by the receive interrupt */
+  volatile uint32_t *bytes_in = &stub_stats.bytes_in;
+
+  stub_io_set_baudrate(current_baud, test_baud);
+
+  /* host to stub: time the frame from the first byte that arrives */
+  uint32_t start_in = *bytes_in;
+  uint32_t last_in = start_in;
+  uint32_t last = stub_ccount();
+  uint32_t idle_cycles = 0, rx_cycles = 0;
+  uint32_t frame_len = 0;
+  uint8_t *frame;
+  while ((frame = stub_rx_next_frame(&frame_len)) == NULL) {
+    stub_io_idle_hook();
+    uint32_t now = stub_ccount();
+    uint32_t elapsed = now - last;
+    last = now;
+    if (last_in != start_in) {
+      rx_cycles += elapsed;
+      if (rx_cycles >= cycles_per_ms) {
+        r.rx_us += 1000;
+        rx_cycles -= cycles_per_ms;
+      }
+    }
+    idle_cycles += elapsed;
+    if (*bytes_in != last_in) {
+      last_in = *bytes_in;
+      idle_cycles = 0;
+    }
+    uint32_t timeout_ms = (last_in == start_in) ? BAUD_TEST_FIRST_BYTE_TIMEOUT_MS : BAUD_TEST_IDLE_TIMEOUT_MS;
+    if (idle_cycles >= timeout_ms * cycles_per_ms) {
+      frame_len = 0;
+      break;
+    }
+  }
+  r.rx_us += rx_cycles * 1000 / cycles_per_ms;
+  if (r.rx_us > 0) {
+    r.rx_bytes_per_s = (uint64_t)(*bytes_in - start_in) * 1000000 / r.rx_us;
+  }
+
+  r.bytes_received = frame_len;
+  uint32_t x = BAUD_TEST_SEED;
+  for (uint32_t i = 0; i < len; i++) {
+    uint8_t expected = baud_test_pattern(&x);
+    if (i < frame_len) {
+      for (uint8_t diff = frame[i] ^ expected; diff != 0; diff &= diff - 1) {
+        r.bit_errors++;
+      }
+    } else {
+      r.bit_errors += 8;
+    }
+  }
+  if (frame_len > len) {
+    r.bit_errors += 8 * (frame_len - len);
+  }
+  r.rx_fifo_overruns = stub_stats.rx_fifo_overruns - overruns;
+  r.slip_errors = stub_stats.slip_errors - slip_errors;
+
+  /* results, then stub to host */
+  esp_command_response_t resp = {
+    .resp = 1,
+    .op_ret = ESP_BAUD_TEST,
+    .len_ret = sizeof(r) + 2,
+    .value = r.bit_errors,
+  };
+  SLIP_send_frame_delimiter();
+  SLIP_send_frame_data_buf(&resp, sizeof(resp));
+  SLIP_send_frame_data_buf(&r, sizeof(r));
+  SLIP_send_frame_data(ESP_OK);
+  SLIP_send_frame_data(0);
+  SLIP_send_frame_delimiter();
+
+  SLIP_send_frame_delimiter();
+  x = BAUD_TEST_SEED;
+  while (len > 0) {
+    uint8_t buf[64];
+    uint32_t n = (len > sizeof(buf)) ? sizeof(buf) : len;
+    for (uint32_t i = 0; i < n; i++) {
+      buf[i] = baud_test_pattern(&x);
+    }
+    SLIP_send_frame_data_buf(buf, n);
+    len -= n;
+  }
+  SLIP_send_frame_delimiter();
+  stub_tx_flush();
+
+  /* After a timeout a partial test frame is still in the receive buffers,
+     and anything else that arrived at the test baud rate is noise. Don't
+     let it run into the host's next command. */
+  stub_rx_reset();
+  stub_io_set_baudrate(test_baud, current_baud);
+}
+
+int handle_get_stats(void)
+{
+  stub_stats_t stats;
+
+  /* the receive interrupt updates some of the 64-bit counters, so take
+     the copy & start counting again for the next operation with it masked */
+  stub_rx_async_enable(false);
+  uint32_t *p = (uint32_t *)&stub_stats;
+  uint32_t *copy = (uint32_t *)&stats;
+  for (int i = 0; i < sizeof(stub_stats) / 4; i++) {
+    copy[i] = p[i];
+    p[i] = 0;
+  }
+  stub_rx_async_enable(true);
+
+  stats.cpu_freq_mhz = ets_get_cpu_frequency();
+  SLIP_send_frame_data_buf(&stats, sizeof(stats));
+  return ESP_OK;
+}
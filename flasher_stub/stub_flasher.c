@@ -27,6 +27,7 @@
  * Actual command handlers are implemented in stub_commands.c
  */
 #include <stdlib.h>
+#include <stddef.h>
 #include "stub_flasher.h"
 #include "rom_functions.h"
 #include "slip.h"
@@ -34,53 +35,210 @@
 #include "stub_write_flash.h"
 #include "stub_io.h"
 #include "soc_support.h"
+#include "stub_stats.h"
+#include "miniz.h"
+
+/* Buffers for reading from UART. Frames are received into a ring of
+   slots, so we can read into free slots while handling data from
+   another one (used for flashing throughput.) By default there are
+   two slots, ESP_SET_RX_WINDOW splits the buffer into more, smaller ones
+   so the host can keep several data blocks in flight.
+
+   The buffers themselves are the .rx_buf section of the linker script. */
+extern uint8_t _rx_buf_start[];
+extern uint8_t _rx_buf_end[];
+
+#define RX_MAX_SLOTS 16
 
-/* Buffers for reading from UART. Data is read double-buffered, so
-   we can read into one buffer while handling data from the other one
-   (used for flashing throughput.) */
 typedef struct {
-  uint8_t buf_a[MAX_WRITE_BLOCK+64];
-  uint8_t buf_b[MAX_WRITE_BLOCK+64];
-  volatile uint8_t *reading_buf; /* Pointer to buf_a, or buf_b - which are we reading_buf? */
+  uint32_t slot_len; /* size of each slot, slots start at _rx_buf_start */
+  uint32_t num_slots;
+  uint32_t head; /* frames received, free-running. Written by RX */
+  uint32_t tail; /* frames finished with by the main thread, free-running */
+  uint8_t write_slot; /* slot the next frame is received into */
+  uint8_t read_slot; /* oldest slot not yet finished with */
+  bool holding; /* main thread is using the frame in read_slot */
   uint16_t read; /* how many bytes have we read in the frame */
   slip_state_t state;
-  esp_command_req_t *command; /* Pointer to buf_a or buf_b as latest command received */
+  uint8_t reading_checksum; /* Running checksum of the data payload being received */
+  uint16_t frame_len[RX_MAX_SLOTS]; /* Length of the frame in each slot */
+  uint8_t frame_checksum[RX_MAX_SLOTS]; /* Checksum of the data payload in each slot */
 } uart_buf_t;
 static volatile uart_buf_t ub;
 
+stub_stats_t stub_stats;
+
 /* esptool protcol "checksum" is XOR of 0xef and each byte of
-   data payload. */
-static uint8_t calculate_checksum(uint8_t *buf, int length)
+   data payload. The payload is everything after the command header
+   and the 16 bytes of data words. */
+#define CHECKSUM_SEED 0xef
+#define PAYLOAD_OFFSET (offsetof(esp_command_req_t, data_buf) + 16)
+
+/* XOR each byte of buf into res, a word at a time where possible */
+static uint8_t checksum_update(uint8_t res, const uint8_t *buf, uint32_t length)
 {
-  uint8_t res = 0xef;
-  for(int i = 0; i < length; i++) {
-    res ^= buf[i];
+  while (length > 0 && ((uintptr_t)buf & 3) != 0) {
+    res ^= *buf++;
+    length--;
+  }
+  uint32_t words = 0;
+  for (; length >= 4; length -= 4, buf += 4) {
+    words ^= *(const uint32_t *)buf;
+  }
+  words ^= words >> 16;
+  words ^= words >> 8;
+  res ^= words & 0xff;
+  while (length-- > 0) {
+    res ^= *buf++;
   }
   return res;
 }
 
-static void stub_handle_rx_byte(char byte)
+static uint8_t calculate_checksum(uint8_t *buf, int length)
 {
-  int16_t r = SLIP_recv_byte(byte, (slip_state_t *)&ub.state);
-  if (r >= 0) {
-    ub.reading_buf[ub.read++] = (uint8_t) r;
-    if (ub.read == MAX_WRITE_BLOCK+64) {
-      /* shouldn't happen unless there are data errors */
-      r = SLIP_FINISHED_FRAME;
-    }
+  uint32_t start = stub_ccount();
+  uint8_t res = checksum_update(CHECKSUM_SEED, buf, length > 0 ? length : 0);
+  stub_stats.cycles_checksum += stub_ccount() - start;
+  return res;
+}
+
+static uint8_t *rx_slot(uint32_t slot)
+{
+  return _rx_buf_start + slot * ub.slot_len;
+}
+
+/* Where RX should store the frame being received */
+static uint8_t *rx_reading_buf(void)
+{
+  if (ub.read == 0 && ub.head - ub.tail == ub.num_slots) {
+    /* Every slot is queued or in use, the host didn't respect the window.
+       Replace the newest queued frame, same as the old double buffer did
+       (read_flash acks are cumulative, so only the newest one matters).
+       A data block lost this way fails the next one's sequence check. */
+    ub.write_slot = (ub.write_slot == 0) ? ub.num_slots - 1 : ub.write_slot - 1;
+    ub.head--;
+    stub_stats.rx_frames_dropped++;
   }
-  if (r == SLIP_FINISHED_FRAME) {
-    /* end of frame, set 'command'
-       to be processed by main thread */
-    if(ub.reading_buf == ub.buf_a) {
-      ub.command = (esp_command_req_t *)ub.buf_a;
-      ub.reading_buf = ub.buf_b;
-    } else {
-      ub.command = (esp_command_req_t *)ub.buf_b;
-      ub.reading_buf = ub.buf_a;
+  return rx_slot(ub.write_slot);
+}
+
+static void stub_rx_frame_finished(void)
+{
+  /* end of frame, queue it to be processed by main thread */
+  ub.frame_len[ub.write_slot] = ub.read;
+  ub.frame_checksum[ub.write_slot] = ub.reading_checksum;
+  ub.write_slot = (ub.write_slot + 1 == ub.num_slots) ? 0 : ub.write_slot + 1;
+  ub.head++;
+  ub.reading_checksum = CHECKSUM_SEED;
+  ub.read = 0;
+}
+
+static void stub_handle_rx_buf(const uint8_t *data, uint32_t len)
+{
+  uint32_t start_cycles = stub_ccount();
+  uint32_t checksum_cycles = 0;
+  while (len > 0) {
+    uint8_t *reading_buf = rx_reading_buf();
+    uint32_t start = ub.read;
+    uint32_t read = start;
+    bool finished;
+    uint32_t used = SLIP_recv_buf(data, len, (slip_state_t *)&ub.state,
+                                  reading_buf, &read, ub.slot_len, &finished);
+    /* a full buffer also finishes the frame, which
+       shouldn't happen unless there are data errors */
+    if (start < PAYLOAD_OFFSET) {
+      start = PAYLOAD_OFFSET;
+    }
+    if (read > start) {
+      /* checksum the new payload bytes while they're still in cache */
+      uint32_t checksum_start = stub_ccount();
+      ub.reading_checksum = checksum_update(ub.reading_checksum,
+                                            reading_buf + start,
+                                            read - start);
+      checksum_cycles += stub_ccount() - checksum_start;
     }
-    ub.read = 0;
+    ub.read = read;
+    if (finished) {
+      stub_rx_frame_finished();
+    }
+    data += used;
+    len -= used;
   }
+  stub_stats.cycles_checksum += checksum_cycles;
+  stub_stats.cycles_rx += stub_ccount() - start_cycles - checksum_cycles;
+}
+
+uint8_t *stub_rx_next_frame(uint32_t *len)
+{
+  if (ub.holding) {
+    /* done with the last frame, its slot can take a new one */
+    ub.holding = false;
+    ub.read_slot = (ub.read_slot + 1 == ub.num_slots) ? 0 : ub.read_slot + 1;
+    ub.tail++;
+  }
+  if (ub.head == ub.tail) {
+    return NULL;
+  }
+  ub.holding = true;
+  *len = ub.frame_len[ub.read_slot];
+  return rx_slot(ub.read_slot);
+}
+
+void stub_rx_reset(void)
+{
+  stub_rx_async_enable(false);
+  ub.write_slot = 0;
+  ub.read_slot = 0;
+  ub.head = 0;
+  ub.tail = 0;
+  ub.holding = false;
+  ub.read = 0;
+  ub.state = SLIP_NO_FRAME;
+  ub.reading_checksum = CHECKSUM_SEED;
+  stub_rx_async_enable(true);
+}
+
+/* Number of receive slots to use for blocks of block_size bytes:
+   ESP_SET_RX_WINDOW returns this minus one (the frame being processed)
+   as the number of frames the host can have in flight. */
+static uint32_t rx_window_slots(uint32_t block_size)
+{
+  if (block_size > _rx_buf_end - _rx_buf_start) {
+    return 0;
+  }
+  /* rx_set_slots() rounds the slot length down to whole words, so make
+     sure a block_size that isn't still fits after that */
+  uint32_t slots = (_rx_buf_end - _rx_buf_start) / (((block_size + 3) & ~3) + 64);
+  return slots > RX_MAX_SLOTS ? RX_MAX_SLOTS : slots;
+}
+
+static void rx_set_slots(uint32_t num_slots)
+{
+  stub_rx_async_enable(false);
+  uint32_t slot_len = ((_rx_buf_end - _rx_buf_start) / num_slots) & ~3;
+  /* Only a frame the host sent after our last response can be arriving,
+     move what we have of it to the start of the new first slot */
+  uint8_t *from = rx_slot(ub.write_slot);
+  uint32_t partial = ub.read;
+  for (int i = 0; i < partial; i++) {
+    _rx_buf_start[i] = from[i];
+  }
+  ub.slot_len = slot_len;
+  ub.num_slots = num_slots;
+  ub.write_slot = 0;
+  ub.read_slot = 0;
+  ub.head = 0;
+  ub.tail = 0;
+  ub.holding = false;
+  ub.read = partial;
+  stub_rx_async_enable(true);
+}
+
+/* Largest block_size accepted by FLASH_BEGIN & co, so that a data
+   command (header, 16 bytes of parameters, payload) fits in a buffer */
+static uint32_t max_write_block(void)
+{
+  return ub.slot_len - 64;
 }
 
 static esp_command_error verify_data_len(esp_command_req_t *command, uint8_t len)
@@ -88,14 +246,55 @@ static esp_command_error verify_data_len(esp_command_req_t *command, uint8_t len
   return (command->data_len == len) ? ESP_OK : ESP_BAD_DATA_LEN;
 }
 
+/* Some commands accept an optional flags word after their 'len' bytes of parameters */
+static esp_command_error verify_data_len_flags(esp_command_req_t *command, uint8_t len)
+{
+  return (command->data_len == len || command->data_len == len + 4) ? ESP_OK : ESP_BAD_DATA_LEN;
+}
+
+static uint32_t get_command_flags(esp_command_req_t *command, uint8_t len)
+{
+  uint32_t *data_words = (uint32_t *)command->data_buf;
+  return (command->data_len == len + 4) ? data_words[len / 4] : 0;
+}
+
+/* Commands which can't run while a background erase is in progress */
+static bool command_uses_flash(uint8_t op)
+{
+  switch (op) {
+  case ESP_FLASH_BEGIN:
+  case ESP_FLASH_DEFLATED_BEGIN:
+  case ESP_FLASH_LZ4_BEGIN:
+  case ESP_FLASH_SEGMENTS_BEGIN:
+  case ESP_FLASH_COPY:
+  case ESP_FLASH_FILL:
+  case ESP_ERASE_FLASH:
+  case ESP_ERASE_REGION:
+  case ESP_READ_FLASH:
+  case ESP_READ_FLASH_DEFLATED:
+  case ESP_FLASH_VERIFY_MD5:
+  case ESP_FLASH_SECTOR_MD5:
+  case ESP_FLASH_MULTI_MD5:
+  case ESP_FLASH_VERIFY_DIGEST:
+  case ESP_SPI_SET_PARAMS:
+  case ESP_SPI_ATTACH:
+  case ESP_RUN_USER_CODE:
+    return true;
+  default:
+    return false;
+  }
+}
+
 void cmd_loop() {
   while(1) {
     /* Wait for a command */
-    while(ub.command == NULL) {
+    esp_command_req_t *command;
+    uint32_t command_len;
+    while((command = (esp_command_req_t *)stub_rx_next_frame(&command_len)) == NULL) {
       stub_io_idle_hook();
+      stub_flash_idle_hook();
     }
-    esp_command_req_t *command = ub.command;
-    ub.command = NULL;
+    uint8_t payload_checksum = ub.frame_checksum[ub.read_slot];
     /* provide easy access for 32-bit data words */
     uint32_t *data_words = (uint32_t *)command->data_buf;
 
@@ -114,9 +313,49 @@ void cmd_loop() {
             resp.value = READ_REG(data_words[0]);
         }
         break;
+    case ESP_GET_MAX_BLOCK_SIZE:
+        /* for the receive slots in use, see ESP_SET_RX_WINDOW */
+        resp.value = max_write_block();
+        break;
+    case ESP_SET_RX_WINDOW:
+        if (command->data_len == 4) {
+            resp.value = rx_window_slots(data_words[0]) - 1;
+        }
+        break;
+    case ESP_FLASH_DATA:
+    case ESP_FLASH_DEFLATED_DATA:
+    case ESP_FLASH_LZ4_DATA:
+#if !ESP8266
+    case ESP_FLASH_ENCRYPT_DATA:
+#endif
+        /* ack by sequence number, for hosts with several blocks in flight */
+        resp.value = data_words[1];
+        break;
     case ESP_FLASH_VERIFY_MD5:
+    case ESP_FLASH_COPY:
+    case ESP_FLASH_FILL:
         resp.len_ret = 16 + 2; /* Will sent 16 bytes of data with MD5 value */
         break;
+    case ESP_FLASH_MULTI_MD5:
+        resp.len_ret = 16 * (command->data_len / 8) + 2;
+        break;
+    case ESP_ERASE_STATUS:
+        resp.value = get_flash_erase_remaining();
+        break;
+    case ESP_GET_STATS:
+        resp.len_ret = sizeof(stub_stats_t) + 2;
+        break;
+    case ESP_FLASH_VERIFY_DIGEST:
+        resp.len_ret = FLASH_DIGEST_LEN + 2;
+        resp.value = FLASH_DIGEST_LEN;
+        break;
+    case ESP_FLASH_SECTOR_MD5:
+        /* Will send 16 bytes of MD5 value for each sector in the range */
+        if (command->data_len == 12 && data_words[2] != 0
+            && sector_md5_count(data_words[1], data_words[2]) <= SECTOR_MD5_MAX_SECTORS) {
+            resp.len_ret = 16 * sector_md5_count(data_words[1], data_words[2]) + 2;
+        }
+        break;
     default:
         break;
     }
@@ -125,28 +364,53 @@ void cmd_loop() {
     SLIP_send_frame_delimiter();
     SLIP_send_frame_data_buf(&resp, sizeof(esp_command_response_t));
 
-    if(command->data_len > MAX_WRITE_BLOCK+16) {
+    if(command->data_len > max_write_block()+16) {
       SLIP_send_frame_data(ESP_BAD_DATA_LEN);
       SLIP_send_frame_data(0xEE);
       SLIP_send_frame_delimiter();
+      stub_tx_push();
       continue;
     }
 
-    /* ... ESP_FLASH_VERIFY_MD5 will insert in-frame response data
+    /* ... ESP_FLASH_VERIFY_MD5 and ESP_FLASH_SECTOR_MD5 will insert in-frame response data
        between here and when we send the status bytes at the
        end of the frame */
 
     esp_command_error error = ESP_CMD_NOT_IMPLEMENTED;
     int status = 0;
 
+    /* Commands which only read flash can use the faster read mode */
+    bool fast_read = (command->op == ESP_FLASH_VERIFY_MD5
+                      || command->op == ESP_FLASH_SECTOR_MD5
+                      || command->op == ESP_FLASH_MULTI_MD5
+                      || command->op == ESP_FLASH_VERIFY_DIGEST
+                      || command->op == ESP_READ_FLASH
+                      || command->op == ESP_READ_FLASH_DEFLATED);
+    /* A background erase has to finish before anything else touches the flash */
+    if (command_uses_flash(command->op)) {
+      flash_erase_wait();
+    }
+    if (fast_read) {
+      spi_fast_read_begin();
+    }
+
     /* First stage of command processing - before sending error/status */
     switch (command->op) {
     case ESP_ERASE_FLASH:
-      error = verify_data_len(command, 0) || SPIEraseChip();
+      /* Optional param is flags (ERASE_ASYNC) */
+      if (get_command_flags(command, 0) & ERASE_ASYNC) {
+        error = verify_data_len_flags(command, 0) || handle_flash_erase_chip_async();
+      } else {
+        error = verify_data_len_flags(command, 0) || SPIEraseChip();
+      }
       break;
     case ESP_ERASE_REGION:
-      /* Params for ERASE_REGION are addr, len */
-      error = verify_data_len(command, 8) || handle_flash_erase(data_words[0], data_words[1]);
+      /* Params for ERASE_REGION are addr, len, flags (optional, ERASE_ASYNC) */
+      if (get_command_flags(command, 8) & ERASE_ASYNC) {
+        error = verify_data_len_flags(command, 8) || handle_flash_erase_async(data_words[0], data_words[1]);
+      } else {
+        error = verify_data_len_flags(command, 8) || handle_flash_erase(data_words[0], data_words[1]);
+      }
       break;
     case ESP_SET_BAUD:
       /* ESP_SET_BAUD sends two args, new and old baud rates */
@@ -154,43 +418,113 @@ void cmd_loop() {
       /* actual baud setting happens after we send the reply */
       break;
     case ESP_READ_FLASH:
+    case ESP_READ_FLASH_DEFLATED:
       error = verify_data_len(command, 16);
       /* actual data is sent after we send the reply */
       break;
+    case ESP_BAUD_TEST:
+      /* the pattern has to fit in one receive slot */
+      error = verify_data_len(command, 12);
+      if (error == ESP_OK && data_words[2] > max_write_block()) {
+        error = ESP_BAD_DATA_LEN;
+      }
+      /* test runs after we send the reply */
+      break;
     case ESP_FLASH_VERIFY_MD5:
       /* unsure why the MD5 command has 4 params but we only pass 2 of them,
          but this is in ESP32 ROM so we can't mess with it.
       */
       error = verify_data_len(command, 16) || handle_flash_get_md5sum(data_words[0], data_words[1]);
       break;
+    case ESP_FLASH_COPY:
+      /* params are src, dst, len */
+      error = verify_data_len(command, 12)
+        || handle_flash_copy(data_words[0], data_words[1], data_words[2])
+        || handle_flash_get_md5sum(data_words[1], data_words[2]);
+      break;
+    case ESP_FLASH_FILL:
+      /* params are dst, len, then the pattern bytes */
+      if (command->data_len <= 8) {
+        error = ESP_BAD_DATA_LEN;
+      } else {
+        error = handle_flash_fill(data_words[0], data_words[1], command->data_buf + 8, command->data_len - 8)
+          || handle_flash_get_md5sum(data_words[0], data_words[1]);
+      }
+      break;
+    case ESP_FLASH_MULTI_MD5:
+      if (command->data_len == 0 || command->data_len % 8 != 0) {
+        error = ESP_BAD_DATA_LEN;
+      } else {
+        error = handle_flash_get_md5sums(data_words, command->data_len / 8);
+      }
+      break;
+    case ESP_FLASH_VERIFY_DIGEST:
+      /* params are addr, len */
+      error = verify_data_len(command, 8) || handle_flash_get_digest(data_words[0], data_words[1]);
+      break;
+    case ESP_FLASH_SECTOR_MD5:
+      /* Params are addr, len, sector_size (FLASH_SECTOR_SIZE or FLASH_BLOCK_SIZE).
+         Lets the host find out which sectors differ from the new image
+         in one round trip, and only rewrite those. */
+      error = verify_data_len(command, 12) || handle_flash_get_sector_md5sums(data_words[0], data_words[1], data_words[2]);
+      break;
     case ESP_FLASH_BEGIN:
       /* parameters (interpreted differently to ROM flasher):
          0 - erase_size (used as total size to write)
          1 - num_blocks (ignored)
-         2 - block_size (should be MAX_WRITE_BLOCK, relies on num_blocks * block_size >= erase_size)
+         2 - block_size (MAX_WRITE_BLOCK or up to ESP_GET_MAX_BLOCK_SIZE, relies on num_blocks * block_size >= erase_size)
          3 - offset (used as-is)
+         4 - flags (optional, FLASH_BEGIN_xxx)
        */
-        if (command->data_len == 16 && data_words[2] > MAX_WRITE_BLOCK) {
+        if (command->data_len >= 16 && data_words[2] > max_write_block()) {
             error = ESP_BAD_BLOCKSIZE;
         } else {
-            error = verify_data_len(command, 16) || handle_flash_begin(data_words[0], data_words[3]);
+            error = verify_data_len_flags(command, 16) || handle_flash_begin(data_words[0], data_words[3], get_command_flags(command, 16));
         }
       break;
     case ESP_FLASH_DEFLATED_BEGIN:
       /* parameters:
          0 - uncompressed size
          1 - num_blocks (based on compressed size)
-         2 - block_size (should be MAX_WRITE_BLOCK, total bytes over serial = num_blocks * block_size)
+         2 - block_size (MAX_WRITE_BLOCK or up to ESP_GET_MAX_BLOCK_SIZE, total bytes over serial = num_blocks * block_size)
          3 - offset (used as-is)
+         4 - flags (optional, FLASH_BEGIN_xxx)
       */
-        if (command->data_len == 16 && data_words[2] > MAX_WRITE_BLOCK) {
+        if (command->data_len >= 16 && data_words[2] > max_write_block()) {
             error = ESP_BAD_BLOCKSIZE;
         } else {
-            error = verify_data_len(command, 16) || handle_flash_deflated_begin(data_words[0], data_words[1] * data_words[2], data_words[3]);
+            error = verify_data_len_flags(command, 16) || handle_flash_deflated_begin(data_words[0], data_words[1] * data_words[2], data_words[3], get_command_flags(command, 16));
+        }
+        break;
+    case ESP_FLASH_LZ4_BEGIN:
+      /* same parameters as ESP_FLASH_DEFLATED_BEGIN, the end of the
+         compressed data is marked in the stream itself */
+        if (command->data_len >= 16 && data_words[2] > max_write_block()) {
+            error = ESP_BAD_BLOCKSIZE;
+        } else {
+            error = verify_data_len_flags(command, 16) || handle_flash_lz4_begin(data_words[0], data_words[3], get_command_flags(command, 16));
+        }
+        break;
+    case ESP_FLASH_SEGMENTS_BEGIN:
+      /* parameters:
+         0 - codec (FLASH_SEGMENTS_xxx)
+         1 - compressed size (as num_blocks * block_size, for FLASH_SEGMENTS_DEFLATED)
+         2 - block_size (MAX_WRITE_BLOCK or up to ESP_GET_MAX_BLOCK_SIZE)
+         3 - flags (FLASH_BEGIN_xxx)
+         4... - offset, size of each segment
+      */
+        if (command->data_len < 24 || (command->data_len - 16) % 8 != 0) {
+            error = ESP_BAD_DATA_LEN;
+        } else if (data_words[2] > max_write_block()) {
+            error = ESP_BAD_BLOCKSIZE;
+        } else {
+            error = handle_flash_segments_begin(data_words[0], data_words[1], data_words[3],
+                                                &data_words[4], (command->data_len - 16) / 8);
         }
         break;
     case ESP_FLASH_DATA:
     case ESP_FLASH_DEFLATED_DATA:
+    case ESP_FLASH_LZ4_DATA:
 #if !ESP8266
     case ESP_FLASH_ENCRYPT_DATA:
 #endif
@@ -204,10 +538,18 @@ void cmd_loop() {
           /* First byte of data payload header is length (repeated) as a word */
           error = ESP_BAD_DATA_LEN;
         }
-        uint8_t data_checksum = calculate_checksum(command->data_buf + 16, payload_len);
+        /* The RX path already checksummed everything after the data words,
+           which is the payload unless the frame had trailing junk */
+        uint8_t data_checksum = payload_checksum;
+        if (command_len != PAYLOAD_OFFSET + payload_len) {
+          data_checksum = calculate_checksum(command->data_buf + 16, payload_len);
+        }
         if (data_checksum != command->checksum) {
           error = ESP_BAD_DATA_CHECKSUM;
         }
+        if (error == ESP_OK) {
+          error = flash_data_check_seq(data_words[1]);
+        }
       }
       else {
         error = ESP_NOT_IN_FLASH_MODE;
@@ -215,6 +557,7 @@ void cmd_loop() {
       break;
     case ESP_FLASH_END:
     case ESP_FLASH_DEFLATED_END:
+    case ESP_FLASH_LZ4_END:
       error = handle_flash_end();
       break;
     case ESP_SPI_SET_PARAMS:
@@ -225,6 +568,15 @@ void cmd_loop() {
       /* parameter is 'hspi mode' (0, 1 or a pin mask for ESP32. Ignored on ESP8266.) */
       error = verify_data_len(command, 4) || handle_spi_attach(data_words[0]);
       break;
+    case ESP_ERASE_STATUS:
+      error = verify_data_len(command, 0);
+      break;
+    case ESP_GET_STATS:
+      error = verify_data_len(command, 0) || handle_get_stats();
+      break;
+    case ESP_SPI_SET_READ_MODE:
+      error = verify_data_len(command, 8) || handle_spi_set_read_mode(data_words[0], data_words[1]);
+      break;
     case ESP_WRITE_REG:
       /* params are addr, value, mask (ignored), delay_us (ignored) */
       error = verify_data_len(command, 16);
@@ -242,9 +594,24 @@ void cmd_loop() {
     case ESP_MEM_DATA:
         error = handle_mem_data(command->data_buf + 16, command->data_len - 16);
         break;
+    case ESP_MEM_DEFLATED_BEGIN:
+        /* size is the uncompressed size, num_blocks & block_size are ignored */
+        error = verify_data_len(command, 16) || handle_mem_deflated_begin() || handle_mem_begin(data_words[0], data_words[3]);
+        break;
+    case ESP_MEM_DEFLATED_DATA:
+        error = handle_mem_deflated_data(command->data_buf + 16, command->data_len - 16);
+        break;
     case ESP_MEM_END:
         error = verify_data_len(command, 8) || handle_mem_finish();
         break;
+    case ESP_SET_RX_WINDOW:
+        /* parameter is the largest block_size the host will use.
+           The new slots are set up after sending the response */
+        error = verify_data_len(command, 4);
+        if (error == ESP_OK && rx_window_slots(data_words[0]) < 2) {
+            error = ESP_BAD_BLOCKSIZE;
+        }
+        break;
     case ESP_RUN_USER_CODE:
         /* Returning from here will run user code, ie standard boot process
 
@@ -256,6 +623,9 @@ void cmd_loop() {
     SLIP_send_frame_data(error);
     SLIP_send_frame_data(status);
     SLIP_send_frame_delimiter();
+    /* the host may be waiting for this before sending the next block,
+       so don't leave it in the USB packet buffer while writing this one */
+    stub_tx_push();
 
     /* Some commands need to do things after after sending this response */
     if (error == ESP_OK) {
@@ -263,11 +633,24 @@ void cmd_loop() {
       case ESP_SET_BAUD:
         stub_io_set_baudrate(data_words[1], data_words[0]);
         break;
+      case ESP_BAUD_TEST:
+        handle_baud_test(data_words[0], data_words[1], data_words[2]);
+        break;
+      case ESP_SET_RX_WINDOW:
+        /* this command's frame is finished with, so
+           it doesn't matter if the new slots overlap it */
+        rx_set_slots(rx_window_slots(data_words[0]));
+        break;
       case ESP_READ_FLASH:
         /* args are: offset, length, block_size, max_in_flight */
         handle_flash_read(data_words[0], data_words[1], data_words[2],
                           data_words[3]);
         break;
+      case ESP_READ_FLASH_DEFLATED:
+        /* same args as ESP_READ_FLASH, block_size & acks count compressed bytes */
+        handle_flash_read_deflated(data_words[0], data_words[1], data_words[2],
+                                   data_words[3]);
+        break;
       case ESP_FLASH_DATA:
         /* drop into flashing mode, discard 16 byte payload header */
         handle_flash_data(command->data_buf + 16, command->data_len - 16);
@@ -281,7 +664,11 @@ void cmd_loop() {
       case ESP_FLASH_DEFLATED_DATA:
         handle_flash_deflated_data(command->data_buf + 16, command->data_len - 16);
         break;
+      case ESP_FLASH_LZ4_DATA:
+        handle_flash_lz4_data(command->data_buf + 16, command->data_len - 16);
+        break;
       case ESP_FLASH_DEFLATED_END:
+      case ESP_FLASH_LZ4_END:
       case ESP_FLASH_END:
         /* passing 0 as parameter for ESP_FLASH_END means reboot now */
         if (data_words[0] == 0) {
@@ -298,6 +685,7 @@ void cmd_loop() {
                  of the UART before we run the new code */
               stub_tx_flush();
               ets_delay_us(1000);
+              flash_worker_stop();
               /* this is a little different from the ROM loader,
                  which exits the loader routine and _then_ calls this
                  function. But for our purposes so far, having a bit of
@@ -308,6 +696,10 @@ void cmd_loop() {
           break;
       }
     }
+
+    if (fast_read) {
+      spi_fast_read_end();
+    }
   }
 }
 
@@ -318,7 +710,7 @@ extern uint32_t _bss_end;
 void __attribute__((used)) stub_main();
 
 
-#ifdef ESP8266
+#if defined(ESP8266) && !defined(STUB_BENCH)
 __asm__ (
   ".global stub_main_8266\n"
   ".literal_position\n"
@@ -352,10 +744,13 @@ void stub_main()
     *p = 0;
   }
 
+  stub_stats_init();
   SLIP_send(&greeting, 4);
 
-  ub.reading_buf = ub.buf_a;
-  stub_io_init(&stub_handle_rx_byte);
+  ub.num_slots = 2;
+  ub.slot_len = ((_rx_buf_end - _rx_buf_start) / 2) & ~3;
+  ub.reading_checksum = CHECKSUM_SEED;
+  stub_io_init(&stub_handle_rx_buf);
 
   /* Configure default SPI flash functionality.
      Can be overriden later by esptool.py. */
@@ -376,10 +771,55 @@ void stub_main()
 #endif
         SPIParamCfg(0, 16*1024*1024, FLASH_BLOCK_SIZE, FLASH_SECTOR_SIZE,
                     FLASH_PAGE_SIZE, FLASH_STATUS_MASK);
+  flash_worker_start();
 
   cmd_loop();
 
   /* if cmd_loop returns, it's due to ESP_RUN_USER_CODE command. */
+  flash_worker_stop();
 
   return;
 }
+
+#if ESP32_OR_LATER
+extern uint32_t _text_start[], _text_end[];
+extern uint32_t _data_start[], _data_end[];
+
+/* Entry point of the compressed stub image (see wrap_stub.py). The ROM
+   loader uploads just the .loader section, and the zlib compressed text
+   & data to the receive buffers: a length word, then the zlib stream.
+   Inflates that into the rest of the receive buffers, copies it into
+   place a word at a time (for IRAM), then starts the stub. On failure
+   it returns to the ROM, and esptool.py never gets its greeting.
+
+   None of the stub is loaded yet, so this can only call ROM code. */
+void __attribute__((used, section(".loader.text"))) stub_loader(void)
+{
+  uint32_t in_len = *(uint32_t *)_rx_buf_start;
+  const uint8_t *in = _rx_buf_start + 4;
+  tinfl_decompressor *inflator = (tinfl_decompressor *)(_rx_buf_start + ((4 + in_len + 3) & ~3));
+  uint32_t *out = (uint32_t *)(inflator + 1);
+  uint32_t text_words = ((uint8_t *)_text_end - (uint8_t *)_text_start + 3) / 4;
+  uint32_t data_words = ((uint8_t *)_data_end - (uint8_t *)_data_start + 3) / 4;
+  size_t in_bytes = in_len;
+  size_t out_bytes = (text_words + data_words) * 4;
+
+  if ((uint8_t *)out + out_bytes > _rx_buf_end) {
+    return;
+  }
+  tinfl_init(inflator);
+  int status = tinfl_decompress(inflator, in, &in_bytes, (uint8_t *)out, (uint8_t *)out, &out_bytes,
+                                TINFL_FLAG_PARSE_ZLIB_HEADER | TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF);
+  if (status != TINFL_STATUS_DONE) {
+    return;
+  }
+
+  for (uint32_t i = 0; i < text_words; i++) {
+    _text_start[i] = *out++;
+  }
+  for (uint32_t i = 0; i < data_words; i++) {
+    _data_start[i] = *out++;
+  }
+  stub_main();
+}
+#endif
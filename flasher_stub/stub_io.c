@@ -20,31 +20,99 @@
 #include "stub_io.h"
 #include "rom_functions.h"
 #include "soc_support.h"
+#include "stub_stats.h"
 
 
 #define UART_RX_INTS (UART_RXFIFO_FULL_INT_ENA | UART_RXFIFO_TOUT_INT_ENA)
 
+/* Size of the UART TX ring buffer, must be a power of 2.
+   Big enough to hold a whole read_flash block, so the
+   next block can be read while the last one is sent.
+   Except on ESP8266, whose DRAM is full with the receive buffers &
+   inflate window: there the ring only overlaps part of each block. */
+#ifdef ESP8266
+#define TX_RING_SIZE 1024
+#else
+#define TX_RING_SIZE 4096
+#endif
+
+#ifdef WITH_USB
+/* USB output is collected and handed to the CDC driver a few full
+   packets at a time, or whatever there is once the stub goes idle */
+#define ACM_TX_BUF_SIZE (8 * ACM_BYTES_PER_TX)
+/* how long the host can leave USB output unread before it's dropped */
+#define ACM_TX_TIMEOUT_MS 500
+#endif
+
+
+static void(*s_rx_buf_cb_func)(const uint8_t *, uint32_t);
 
-static void(*s_rx_cb_func)(char);
+/* UART output is queued in s_tx_ring, and moved into the TX FIFO
+   by uart_isr() (on TX FIFO empty interrupt) or by stub_tx_drain().
+   Head/tail are free-running, head is only written by the main code
+   and tail only by whichever context is currently filling the FIFO. */
+static uint8_t s_tx_ring[TX_RING_SIZE] STUB_NOINIT;
+static volatile uint32_t s_tx_head;
+static volatile uint32_t s_tx_tail;
+static bool s_uart_isr_attached;
+static bool s_uart_isr_unmasked;
 #ifdef WITH_USB
 static uint32_t s_cdcacm_old_rts;
 static volatile bool s_cdcacm_reset_requested;
-static char s_cdcacm_txbuf[ACM_BYTES_PER_TX];
+static uint8_t s_cdcacm_txbuf[ACM_TX_BUF_SIZE] STUB_NOINIT;
 static size_t s_cdcacm_txpos;
+static bool s_cdcacm_isr_unmasked;
 #endif // WITH_USB
 
 
+/* Move as much queued TX data into the UART FIFO as will fit.
+
+   Must only be called from uart_isr(), or with the UART interrupt masked.
+*/
+static void uart_tx_fill_fifo(void)
+{
+  uint32_t tail = s_tx_tail;
+  uint32_t head = s_tx_head;
+  uint32_t fifo_len = (READ_REG(UART_STATUS(0)) >> UART_TXFIFO_CNT_S) & UART_TXFIFO_CNT_M;
+  uint32_t space = UART_FIFO_SIZE - fifo_len;
+
+  while (tail != head && space-- > 0) {
+    WRITE_REG(UART_FIFO_AHB_REG, s_tx_ring[tail % TX_RING_SIZE]);
+    tail++;
+  }
+  s_tx_tail = tail;
+}
+
 void uart_isr(void *arg) {
   uint32_t int_st = READ_REG(UART_INT_ST(0));
+  if (int_st & UART_TXFIFO_EMPTY_INT_ENA) {
+    uart_tx_fill_fifo();
+    if (s_tx_tail == s_tx_head) {
+      /* Nothing more to send, stub_tx_drain() re-enables when there is */
+      REG_CLR_MASK(UART_INT_ENA(0), UART_TXFIFO_EMPTY_INT_ENA);
+    }
+  }
   while (1) {
     uint32_t fifo_len = READ_REG(UART_STATUS(0)) & UART_RXFIFO_CNT_M;
     if (fifo_len == 0) {
       break;
     }
-    while (fifo_len-- > 0) {
-      uint8_t byte = READ_REG(UART_FIFO(0)) & 0xff;
-      (*s_rx_cb_func)(byte);
+    /* Hand over the whole FIFO contents at once, much cheaper
+       than a callback per byte at high baud rates */
+    uint8_t block[UART_FIFO_SIZE];
+    if (fifo_len > sizeof(block)) {
+      fifo_len = sizeof(block);
+    }
+    for (int i = 0; i < fifo_len; i++) {
+      block[i] = READ_REG(UART_FIFO(0)) & 0xff;
     }
+    stub_stats.bytes_in += fifo_len;
+    (*s_rx_buf_cb_func)(block, fifo_len);
+  }
+  /* not enabled as an interrupt, just counted */
+  if (READ_REG(UART_INT_RAW(0)) & UART_RXFIFO_OVF_INT_ENA) {
+    stub_stats.rx_fifo_overruns++;
+    int_st |= UART_RXFIFO_OVF_INT_ENA;
   }
   WRITE_REG(UART_INT_CLR(0), int_st);
 }
@@ -54,18 +122,48 @@ static void stub_configure_rx_uart(void)
   /* All UART reads come via uart_isr */
   ets_isr_attach(ETS_UART0_INUM, uart_isr, NULL);
   REG_SET_MASK(UART_INT_ENA(0), UART_RX_INTS);
+  s_uart_isr_attached = true;
+  s_uart_isr_unmasked = true;
   ets_isr_unmask(1 << ETS_UART0_INUM);
 }
 
+/* Move queued TX data into the UART FIFO without blocking, and
+   make sure uart_isr() will continue with whatever doesn't fit.
+
+   Until uart_isr() is attached, or while async RX is disabled, nothing
+   is sent in the background - callers need to keep calling this.
+ */
+static void stub_tx_drain(void)
+{
+  /* Only one context may write the TX FIFO, keep uart_isr() out meanwhile */
+  ets_isr_mask(1 << ETS_UART0_INUM);
+  uart_tx_fill_fifo();
+  if (s_uart_isr_attached && s_tx_tail != s_tx_head) {
+    REG_SET_MASK(UART_INT_ENA(0), UART_TXFIFO_EMPTY_INT_ENA);
+  }
+  if (s_uart_isr_unmasked) {
+    ets_isr_unmask(1 << ETS_UART0_INUM);
+  }
+}
+
 #ifdef WITH_USB
 
 void stub_cdcacm_cb(cdc_acm_device *dev, int status)
 {
   if (status == ACM_STATUS_RX) {
-    while (cdc_acm_rx_fifo_cnt(uart_acm_dev) > 0) {
-      uint8_t c;
-      cdc_acm_fifo_read(uart_acm_dev, &c, 1);
-      (*s_rx_cb_func)((char) c);
+    /* a packet at a time into the SLIP decoder, as for the UART FIFO */
+    uint8_t block[ACM_BYTES_PER_TX];
+    int len;
+    while ((len = cdc_acm_rx_fifo_cnt(uart_acm_dev)) > 0) {
+      if (len > sizeof(block)) {
+        len = sizeof(block);
+      }
+      len = cdc_acm_fifo_read(uart_acm_dev, block, len);
+      if (len <= 0) {
+        break;
+      }
+      stub_stats.bytes_in += len;
+      (*s_rx_buf_cb_func)(block, len);
     }
   } else if (status == ACM_STATUS_LINESTATE_CHANGED) {
     uint32_t rts = 0;
@@ -77,18 +175,61 @@ void stub_cdcacm_cb(cdc_acm_device *dev, int status)
   }
 }
 
+/* Hand everything in s_cdcacm_txbuf to the CDC driver, a packet at a time.
+   Waits while the driver's buffer is full, but no more than
+   ACM_TX_TIMEOUT_MS without progress: if the host has gone away or the
+   endpoint fails, the rest is dropped (like the original stub, which
+   ignored cdc_acm_fifo_fill() errors) rather than hanging the stub. */
 static void stub_cdcacm_flush(void)
 {
-    cdc_acm_fifo_fill(uart_acm_dev, (const uint8_t *) s_cdcacm_txbuf, s_cdcacm_txpos);
-    /* return value ignored — if bootloader fails to log something, proceed anyway */
+    const uint8_t *p = s_cdcacm_txbuf;
+    const uint8_t *end = s_cdcacm_txbuf + s_cdcacm_txpos;
+    uint32_t cycles_per_ms = ets_get_cpu_frequency() * 1000;
+    uint32_t last = stub_ccount();
+    uint32_t stalled_cycles = 0, stalled_ms = 0;
+    while (p < end && stalled_ms < ACM_TX_TIMEOUT_MS) {
+        int len = end - p;
+        if (len > ACM_BYTES_PER_TX) {
+            len = ACM_BYTES_PER_TX;
+        }
+        int written = cdc_acm_fifo_fill(uart_acm_dev, p, len);
+        uint32_t now = stub_ccount();
+        if (written > 0) {
+            p += written;
+            stalled_cycles = 0;
+            stalled_ms = 0;
+        } else {
+            if (!s_cdcacm_isr_unmasked) {
+                /* nothing else is going to send what's queued already */
+                usb_dc_check_poll_for_interrupts();
+            }
+            stalled_cycles += now - last;
+            if (stalled_cycles >= cycles_per_ms) {
+                stalled_cycles -= cycles_per_ms;
+                stalled_ms++;
+            }
+        }
+        last = now;
+    }
     s_cdcacm_txpos = 0;
 }
 
-static void stub_cdcacm_write_char(char ch)
+static void stub_cdcacm_write(const uint8_t *p, uint32_t len)
 {
-    s_cdcacm_txbuf[s_cdcacm_txpos++] = ch;
-    if (ch == '\xc0' || s_cdcacm_txpos == sizeof(s_cdcacm_txbuf)) {
-        stub_cdcacm_flush();
+    while (len > 0) {
+        uint32_t n = sizeof(s_cdcacm_txbuf) - s_cdcacm_txpos;
+        if (n > len) {
+            n = len;
+        }
+        for (int i = 0; i < n; i++) {
+            s_cdcacm_txbuf[s_cdcacm_txpos + i] = p[i];
+        }
+        s_cdcacm_txpos += n;
+        p += n;
+        len -= n;
+        if (s_cdcacm_txpos == sizeof(s_cdcacm_txbuf)) {
+            stub_cdcacm_flush();
+        }
     }
 }
 
@@ -103,6 +244,7 @@ static void stub_configure_rx_usb(void)
   intr_matrix_set(0, ETS_USB_INTR_SOURCE, ETS_USB_INUM);
   ets_isr_attach(ETS_USB_INUM, usb_dw_isr_handler, NULL);
   ets_isr_unmask(1 << ETS_USB_INUM);
+  s_cdcacm_isr_unmasked = true;
   cdc_acm_irq_callback_set(uart_acm_dev, &stub_cdcacm_cb);
   cdc_acm_irq_rx_enable(uart_acm_dev);
   cdc_acm_irq_state_enable(uart_acm_dev);
@@ -110,15 +252,49 @@ static void stub_configure_rx_usb(void)
 }
 #endif // !WITH_USB
 
-void stub_tx_one_char(char c)
+void stub_tx_buf(const void *buf, uint32_t len)
 {
+  const uint8_t *p = (const uint8_t *)buf;
+  stub_stats.bytes_out += len;
 #if WITH_USB
   if (stub_uses_usb()) {
-    stub_cdcacm_write_char(c);
+    /* batched, cmd_loop pushes responses out with stub_tx_push() */
+    stub_cdcacm_write(p, len);
     return;
   }
 #endif // WITH_USB
-  uart_tx_one_char(c);
+  while (len > 0) {
+    uint32_t head = s_tx_head;
+    uint32_t space = TX_RING_SIZE - (head - s_tx_tail);
+    if (space == 0) {
+      stub_tx_drain();
+      continue;
+    }
+    if (space > len) {
+      space = len;
+    }
+    for (int i = 0; i < space; i++) {
+      s_tx_ring[(head + i) % TX_RING_SIZE] = p[i];
+    }
+    s_tx_head = head + space;
+    p += space;
+    len -= space;
+  }
+  stub_tx_drain();
+}
+
+void stub_tx_one_char(char c)
+{
+  stub_tx_buf(&c, 1);
+}
+
+void stub_tx_push(void)
+{
+#if WITH_USB
+  if (stub_uses_usb() && s_cdcacm_txpos > 0) {
+    stub_cdcacm_flush();
+  }
+#endif // WITH_USB
 }
 
 void stub_tx_flush(void)
@@ -128,10 +304,17 @@ void stub_tx_flush(void)
     if (s_cdcacm_txpos > 0) {
       stub_cdcacm_flush();
     }
+    return;
   }
 #endif // WITH_USB
+  while (s_tx_tail != s_tx_head) {
+    stub_tx_drain();
+  }
 #if ESP32_OR_LATER
   uart_tx_flush(0);
+#else
+  while ((READ_REG(UART_STATUS(0)) >> UART_TXFIFO_CNT_S) & UART_TXFIFO_CNT_M)
+    { }
 #endif
 }
 
@@ -142,7 +325,17 @@ char stub_rx_one_char(void)
    * because the latter simply returns (char) 0 if no bytes
    * are available, when used with USB CDC.
    */
-  while (uart_rx_one_char((uint8_t*) &c) != 0) { }
+#if WITH_USB
+  if (s_cdcacm_txpos > 0) {
+    stub_cdcacm_flush(); /* the host may be waiting for it */
+  }
+#endif // WITH_USB
+  while (uart_rx_one_char((uint8_t*) &c) != 0) {
+    /* TX isn't sent in the background while async RX is disabled */
+    if (s_tx_tail != s_tx_head) {
+      stub_tx_drain();
+    }
+  }
   return c;
 }
 
@@ -152,6 +345,7 @@ void stub_rx_async_enable(bool enable)
 #if WITH_USB
   if (stub_uses_usb()) {
     mask = 1 << ETS_USB_INUM;
+    s_cdcacm_isr_unmasked = enable;
     if (enable) {
       cdc_acm_irq_rx_enable(uart_acm_dev);
       ets_isr_unmask(mask);
@@ -163,6 +357,7 @@ void stub_rx_async_enable(bool enable)
   }
 #endif // WITH_USB
   mask = 1 << ETS_UART0_INUM;
+  s_uart_isr_unmasked = enable;
   if (enable) {
     ets_isr_unmask(mask);
   } else {
@@ -172,7 +367,14 @@ void stub_rx_async_enable(bool enable)
 
 void stub_io_idle_hook(void)
 {
+  if (s_tx_tail != s_tx_head) {
+    stub_tx_drain();
+  }
 #if WITH_USB
+  /* waiting for the host, so send whatever output there is */
+  if (s_cdcacm_txpos > 0) {
+    stub_cdcacm_flush();
+  }
   if (s_cdcacm_reset_requested)
   {
     s_cdcacm_reset_requested = false;
@@ -188,9 +390,9 @@ void stub_io_idle_hook(void)
 #endif // WITH_USB
 }
 
-void stub_io_init(void(*rx_cb_func)(char))
+void stub_io_init(void(*rx_buf_cb_func)(const uint8_t *, uint32_t))
 {
-  s_rx_cb_func = rx_cb_func;
+  s_rx_buf_cb_func = rx_buf_cb_func;
 #if WITH_USB
   if (stub_uses_usb()) {
     stub_configure_rx_usb();
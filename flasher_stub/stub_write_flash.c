@@ -18,8 +18,11 @@
  */
 #include "soc_support.h"
 #include "stub_write_flash.h"
+#include "stub_commands.h"
 #include "stub_flasher.h"
 #include "rom_functions.h"
+#include "stub_io.h"
+#include "stub_stats.h"
 #include "miniz.h"
 
 /* local flashing state
@@ -41,13 +44,131 @@ static struct {
   int remaining_erase_sector;
   /* last error generated by a data packet */
   esp_command_error last_error;
+  /* sequence number the next data packet has to have */
+  uint32_t next_seq;
+  /* FLASH_BEGIN_xxx flags for this session */
+  uint32_t flags;
+  /* ERASE_ASYNC chip erase waiting for the flash to be ready */
+  bool erase_chip;
+  /* SPI_Write_Encrypt_Enable() has been called this session */
+  bool encrypt_enabled;
+
+  /* segments of this session, in flash order. FLASH_BEGIN & co have
+     just the one. fs.next_write & fs.remaining are for the current
+     segment, erase-ahead runs through all of them. */
+  struct {
+    uint32_t offset;
+    uint32_t size;
+  } segments[FLASH_MAX_SEGMENTS];
+  uint8_t num_segments;
+  uint8_t write_segment;
+  uint8_t erase_segment;
+
+  /* page program in progress, see flash_program_poll() */
+  uint32_t program_addr;
+  const uint8_t *program_data;
+  uint32_t program_len;
 
-  /* inflator state for deflate write */
-  tinfl_decompressor inflator;
   /* number of compressed bytes remaining to read */
   uint32_t remaining_compressed;
+  /* bytes of inflate_out_buf filled by tinfl so far */
+  uint32_t out_len;
+  /* bytes of inflate_out_buf handed to the page program engine */
+  uint32_t out_flushed;
+  /* decompressed bytes the session is for, and produced so far. Output
+     past the end is dropped by write_behind_poll(), these catch it
+     (PRO_CPU only) */
+  uint32_t out_expected;
+  uint32_t out_total;
+  /* last tinfl_decompress() result, it carries on across data blocks */
+  int inflate_status;
+
+  /* decoder state for LZ4 write, see lz4_decode() */
+  uint8_t lz4_state;
+  uint8_t lz4_token;
+  /* length being read, or bytes left to copy */
+  uint32_t lz4_count;
+  uint32_t lz4_offset;
+  /* compressed bytes left in the current block */
+  uint32_t lz4_block_left;
+  /* offset of the current block in inflate_out_buf */
+  uint32_t lz4_block_start;
 } fs;
 
+/* tinfl (or LZ4) output window, data is written to flash from here
+   as each sector of it fills up (see write_behind_poll()) */
+static uint8_t inflate_out_buf[32768] __attribute__((aligned(4))) STUB_NOINIT;
+
+/* inflator state for deflate write (and deflated RAM loading) */
+static tinfl_decompressor inflator STUB_NOINIT;
+
+/* Most input tinfl gets per call. Its output has to run up to the end of
+   the window (that's how it knows the window size), so limit the input
+   instead: this inflates to roughly what the page program engine writes
+   per command, and it gets to issue the next one soon after the flash
+   chip is ready for it */
+#define INFLATE_IN_SLICE (SPI_W_NUM * 4)
+
+/* LZ4 decodes much faster than that, so it can take a bigger slice */
+#define LZ4_IN_SLICE (INFLATE_IN_SLICE * 4)
+
+typedef enum {
+  LZ4_HEADER,        /* reading the block size word */
+  LZ4_TOKEN,
+  LZ4_LITERALS_EXT,  /* reading literal length bytes after the token */
+  LZ4_LITERALS,
+  LZ4_OFFSET_LO,
+  LZ4_OFFSET_HI,
+  LZ4_MATCH_EXT,     /* reading match length bytes after the offset */
+  LZ4_MATCH,         /* (doesn't need input, copied straight away) */
+  LZ4_DONE,          /* seen the end mark */
+} lz4_state_t;
+
+#if STUB_DUAL_CORE
+/* The APP_CPU flash worker runs write_behind_poll() while the PRO_CPU
+   inflates. fs.out_len & fs.out_flushed are the two ends of a single
+   producer, single consumer queue in inflate_out_buf, everything else
+   in fs belongs to the worker while it's running. */
+typedef enum {
+  WORKER_IDLE,  /* parked, the PRO_CPU has the flash & fs (set by worker) */
+  WORKER_RUN,   /* set by PRO_CPU when idle */
+  WORKER_STOP,  /* set by PRO_CPU when running, to park it */
+} worker_state_t;
+
+static volatile uint32_t s_worker_state;
+#endif
+
+/* Order SRAM accesses with the other CPU, compiler & hardware */
+static inline void worker_barrier(void)
+{
+#if STUB_DUAL_CORE
+  __asm__ __volatile__("memw" ::: "memory");
+#endif
+}
+
+/* Hand the flash & fs back to the PRO_CPU, waits for the worker to
+   finish what it is doing. Nothing to do on single core chips. */
+static void write_behind_park(void)
+{
+#if STUB_DUAL_CORE
+  if (s_worker_state == WORKER_RUN) {
+    s_worker_state = WORKER_STOP;
+  }
+  while (s_worker_state != WORKER_IDLE)
+    { }
+  worker_barrier();
+#endif
+}
+
+/* Make the first 'out_len' bytes of inflate_out_buf available for
+   writing, the output has to be in SRAM before the worker sees it */
+static inline void write_behind_publish(uint32_t out_len)
+{
+  worker_barrier();
+  fs.out_total += out_len - fs.out_len;
+  fs.out_len = out_len;
+}
+
 /* SPI status bits */
 static const uint32_t STATUS_WIP_BIT = (1 << 0);
 #if ESP32_OR_LATER
@@ -64,6 +185,15 @@ esp_command_error get_flash_error(void)
   return fs.last_error;
 }
 
+esp_command_error flash_data_check_seq(uint32_t seq)
+{
+  if (seq != fs.next_seq) {
+    return ESP_BAD_SEQUENCE;
+  }
+  fs.next_seq++;
+  return ESP_OK;
+}
+
 /* Wait for the SPI state machine to be ready,
    ie no command in progress in the internal host.
 */
@@ -105,6 +235,35 @@ static void spi_write_enable(void)
     { }
 }
 
+#if !ESP8266
+/* Write with flash encryption, using the ROM. Waits until the write is
+   finished. 'addr' and 'len' have to be multiples of FLASH_ENCRYPT_ALIGN.
+*/
+static bool flash_encrypt_write(uint32_t addr, const void *data, uint32_t len)
+{
+#if ESP32
+  return esp_rom_spiflash_write_encrypted(addr, data, len) == 0;
+#else
+  if (!fs.encrypt_enabled) {
+    /* once per session, see flash_encrypt_end() */
+    SPI_Write_Encrypt_Enable();
+    fs.encrypt_enabled = true;
+  }
+  return SPI_Encrypt_Write(addr, data, len) == 0;
+#endif
+}
+#endif // !ESP8266
+
+static void flash_encrypt_end(void)
+{
+#if ESP32S2_OR_LATER
+  if (fs.encrypt_enabled) {
+    SPI_Write_Encrypt_Disable();
+    fs.encrypt_enabled = false;
+  }
+#endif
+}
+
 #if ESP32_OR_LATER
 static esp_rom_spiflash_chip_t *flashchip = (esp_rom_spiflash_chip_t *)0x3ffae270;
 
@@ -146,13 +305,80 @@ SpiFlashOpResult SPIUnlock(void)
 }
 #endif
 
-esp_command_error handle_flash_begin(uint32_t total_size, uint32_t offset) {
+/* Once erase-ahead has finished a segment, move it on to the next one.
+   Segments are in order, so where one starts in the sector the last one
+   ended in, that sector has already been erased. */
+static void erase_plan_next_segment(void)
+{
+  while (fs.remaining_erase_sector == 0 && fs.erase_segment + 1 < fs.num_segments) {
+    fs.erase_segment++;
+    uint32_t offset = fs.segments[fs.erase_segment].offset;
+    uint32_t size = fs.segments[fs.erase_segment].size;
+    int first = offset / FLASH_SECTOR_SIZE;
+    int end = (offset + size + FLASH_SECTOR_SIZE - 1) / FLASH_SECTOR_SIZE;
+    if (first < fs.next_erase_sector) {
+      first = fs.next_erase_sector;
+    }
+    if (size > 0 && end > first) {
+      fs.next_erase_sector = first;
+      fs.remaining_erase_sector = end - first;
+    }
+  }
+}
+
+/* Once the current segment is written, move on to the next one */
+static void flash_segment_next(void)
+{
+  while (fs.remaining == 0 && fs.write_segment + 1 < fs.num_segments) {
+    fs.write_segment++;
+    fs.next_write = fs.segments[fs.write_segment].offset;
+    fs.remaining = fs.segments[fs.write_segment].size;
+  }
+}
+
+/* Bytes left to write in the whole session */
+static uint32_t flash_remaining_total(void)
+{
+  uint32_t remaining = fs.remaining;
+  for (int i = fs.write_segment + 1; i < fs.num_segments; i++) {
+    remaining += fs.segments[i].size;
+  }
+  return remaining;
+}
+
+esp_command_error handle_flash_begin(uint32_t total_size, uint32_t offset, uint32_t flags) {
+  if (flags & FLASH_BEGIN_ENCRYPT) {
+#if ESP8266
+    return ESP_CMD_NOT_IMPLEMENTED;
+#else
+    if (offset % FLASH_ENCRYPT_ALIGN != 0 || total_size % FLASH_ENCRYPT_ALIGN != 0) {
+      return ESP_BAD_DATA_LEN;
+    }
+#endif
+  }
+  write_behind_park();
+  flash_encrypt_end(); /* in case the last session was never ended */
+
   fs.in_flash_mode = true;
+  fs.flags = flags;
   fs.next_write = offset;
   fs.next_erase_sector = offset / FLASH_SECTOR_SIZE;
   fs.remaining = total_size;
   fs.remaining_erase_sector = ((offset % FLASH_SECTOR_SIZE) + total_size + FLASH_SECTOR_SIZE - 1) / FLASH_SECTOR_SIZE;
   fs.last_error = ESP_OK;
+  fs.next_seq = 0;
+  /* nothing left over from a session that was never finished gets
+     written into this one */
+  fs.out_len = 0;
+  fs.out_flushed = 0;
+  fs.program_len = 0;
+  fs.segments[0].offset = offset;
+  fs.segments[0].size = total_size;
+  fs.num_segments = 1;
+  fs.write_segment = 0;
+  fs.erase_segment = 0;
+  fs.out_expected = total_size;
+  fs.out_total = 0;
 
   if (SPIUnlock() != 0) {
     return ESP_FAILED_SPI_UNLOCK;
@@ -161,14 +387,248 @@ esp_command_error handle_flash_begin(uint32_t total_size, uint32_t offset) {
   return ESP_OK;
 }
 
-esp_command_error handle_flash_deflated_begin(uint32_t uncompressed_size, uint32_t compressed_size, uint32_t offset) {
-  esp_command_error err = handle_flash_begin(uncompressed_size, offset);
-  tinfl_init(&fs.inflator);
+esp_command_error handle_flash_deflated_begin(uint32_t uncompressed_size, uint32_t compressed_size, uint32_t offset, uint32_t flags) {
+  esp_command_error err = handle_flash_begin(uncompressed_size, offset, flags);
+  tinfl_init(&inflator);
+  fs.inflate_status = TINFL_STATUS_NEEDS_MORE_INPUT;
+  fs.out_len = 0;
+  fs.out_flushed = 0;
   fs.remaining_compressed = compressed_size;
   return err;
 }
 
-/* Erase the next sector or block (depending if we're at a block boundary).
+esp_command_error handle_flash_segments_begin(uint32_t codec, uint32_t compressed_size, uint32_t flags,
+                                              const uint32_t *segments, uint32_t num_segments)
+{
+  esp_command_error err;
+
+  if (num_segments == 0 || num_segments > FLASH_MAX_SEGMENTS) {
+    return ESP_BAD_DATA_LEN;
+  }
+  for (int i = 0; i < num_segments; i++) {
+    uint32_t offset = segments[i * 2];
+    uint32_t size = segments[i * 2 + 1];
+    if (offset + size < offset) {
+      return ESP_BAD_ADDRESS;
+    }
+    if (i > 0 && offset < segments[i * 2 - 2] + segments[i * 2 - 1]) {
+      return ESP_BAD_ADDRESS; /* out of order, or overlaps the last one */
+    }
+    /* data carries on to the next segment straight from the buffer it
+       is in, which the page program engine reads a word at a time */
+    if (offset % 4 != 0 || (i < num_segments - 1 && size % 4 != 0)) {
+      return ESP_BAD_DATA_LEN;
+    }
+    if ((flags & FLASH_BEGIN_ENCRYPT)
+        && (offset % FLASH_ENCRYPT_ALIGN != 0 || size % FLASH_ENCRYPT_ALIGN != 0)) {
+      return ESP_BAD_DATA_LEN;
+    }
+  }
+
+  /* set up for the first segment, as for a single region */
+  switch (codec) {
+  case FLASH_SEGMENTS_PLAIN:
+    err = handle_flash_begin(segments[1], segments[0], flags);
+    break;
+  case FLASH_SEGMENTS_DEFLATED:
+    err = handle_flash_deflated_begin(segments[1], compressed_size, segments[0], flags);
+    break;
+  case FLASH_SEGMENTS_LZ4:
+    err = handle_flash_lz4_begin(segments[1], segments[0], flags);
+    break;
+  default:
+    return ESP_BAD_DATA_LEN;
+  }
+
+  for (int i = 0; i < num_segments; i++) {
+    fs.segments[i].offset = segments[i * 2];
+    fs.segments[i].size = segments[i * 2 + 1];
+  }
+  fs.num_segments = num_segments;
+  fs.out_expected = flash_remaining_total();
+  flash_segment_next();
+  erase_plan_next_segment();
+  return err;
+}
+
+/* Native page program engine, used instead of ROM SPIWrite() which
+   blocks on the flash chip after every page.
+
+   flash_program_begin() sets up a write of 'len' bytes from 'data'
+   (which must be word aligned, and stay valid until the write is finished).
+   Each flash_program_poll() issues the next page program command
+   (up to 64 bytes, the size of the SPI W0..W15 buffer) if the flash chip
+   has finished the last one, and returns without waiting. It returns true
+   once all commands have been issued, the last one may still be running:
+   like erases, the next SPI operation waits for it.
+
+   The region has to be erased already (all writes in a session are to
+   sectors the session has erased, or found blank), so commands whose
+   data is all 0xFF are skipped: they wouldn't change anything.
+*/
+static void flash_program_begin(uint32_t addr, const void *data, uint32_t len)
+{
+  fs.program_addr = addr;
+  fs.program_data = data;
+  fs.program_len = len;
+}
+
+/* Length of the next page program command */
+static uint32_t flash_program_next_len(void)
+{
+  /* a page program can't cross a page boundary */
+  uint32_t n = FLASH_PAGE_SIZE - (fs.program_addr % FLASH_PAGE_SIZE);
+  if (n > SPI_W_NUM * 4) {
+    n = SPI_W_NUM * 4;
+  }
+  if (n > fs.program_len) {
+    n = fs.program_len;
+  }
+  return n;
+}
+
+static bool is_all_ff(const uint32_t *words, uint32_t len)
+{
+  for (int i = 0; i < len / 4; i++) {
+    if (words[i] != 0xffffffff) {
+      return false;
+    }
+  }
+  if (len % 4 != 0) {
+    uint32_t mask = (1 << (8 * (len % 4))) - 1; /* (little-endian) */
+    return (words[len / 4] & mask) == mask;
+  }
+  return true;
+}
+
+static bool flash_program_poll(void)
+{
+  uint32_t n;
+  const uint32_t *words;
+
+  /* doesn't need to wait for the flash chip */
+  while (true) {
+    if (fs.program_len == 0) {
+      return true;
+    }
+    n = flash_program_next_len();
+    words = (const uint32_t *)fs.program_data;
+    if (!is_all_ff(words, n)) {
+      break;
+    }
+    fs.program_addr += n;
+    fs.program_data += n;
+    fs.program_len -= n;
+  }
+
+  if (!spiflash_is_ready()) {
+    return false;
+  }
+
+  spi_write_enable();
+  for (int i = 0; i < (n + 3) / 4; i++) {
+    WRITE_REG(SPI_W0_REG + i * 4, words[i]);
+  }
+  /* plain 0x02 page program: no dummy cycles or multi line data left
+     over from a read mode the ROM (or the host) set up */
+  uint32_t user = READ_REG(SPI_USER_REG);
+  WRITE_REG(SPI_USER_REG, user & ~(SPI_USR_DUMMY | SPI_FWRITE_MODE_M));
+  WRITE_REG(SPI_ADDR_REG, (fs.program_addr & 0xffffff) | (n << SPI_ADDR_LEN_S));
+  WRITE_REG(SPI_CMD_REG, SPI_FLASH_PP);
+  while(READ_REG(SPI_CMD_REG) != 0)
+    { }
+  WRITE_REG(SPI_USER_REG, user);
+
+  fs.program_addr += n;
+  fs.program_data += n;
+  fs.program_len -= n;
+  return fs.program_len == 0;
+}
+
+/* Returns true if the flash region reads back as all 0xFF.
+
+   Reading is much faster than erasing (especially for a 64KB block),
+   so checking first pays off on new or freshly erased chips.
+ */
+static bool flash_region_is_erased(uint32_t addr, uint32_t len)
+{
+  uint32_t buf[1024 / sizeof(uint32_t)]; /* small, this can be called deep in the write path */
+
+  while (len > 0) {
+    uint32_t n = len < sizeof(buf) ? len : sizeof(buf);
+    if (SPIRead(addr, buf, n) != 0) {
+      return false;
+    }
+    uint32_t all = 0xFFFFFFFF;
+    for (int i = 0; i < n / 4; i++) {
+      all &= buf[i];
+    }
+    if (all != 0xFFFFFFFF) {
+      return false;
+    }
+    addr += n;
+    len -= n;
+  }
+  return true;
+}
+
+/* Erase planner: returns the number of sectors the next erase command
+   should cover, starting at 'sector' and with 'num_sectors' left.
+
+   Erase time per byte goes down with the size of the erase, so use the
+   biggest of 64KB block / 32KB block / 4KB sector erase which is aligned
+   at 'sector' and fits. Since the sizes are all powers of two, doing this
+   greedily gives the shortest command sequence for any region.
+*/
+static uint32_t flash_erase_plan(uint32_t sector, uint32_t num_sectors)
+{
+  if (num_sectors >= SECTORS_PER_BLOCK && sector % SECTORS_PER_BLOCK == 0) {
+    return SECTORS_PER_BLOCK;
+  }
+  if (num_sectors >= SECTORS_PER_HALF_BLOCK && sector % SECTORS_PER_HALF_BLOCK == 0) {
+    return SECTORS_PER_HALF_BLOCK;
+  }
+  return 1;
+}
+
+/* Issue an erase command for 'num_sectors' (as returned by flash_erase_plan)
+   sectors starting at 'sector'. Waits for the flash to be ready for it, but
+   not for the erase to complete.
+ */
+static void flash_erase_issue(uint32_t sector, uint32_t num_sectors)
+{
+  uint32_t addr = sector * FLASH_SECTOR_SIZE;
+
+  spi_write_enable();
+  spi_wait_ready();
+
+  if (num_sectors == SECTORS_PER_HALF_BLOCK) {
+    /* No SPI_CMD_REG bit for 32KB block erase (0x52), send it as a user
+       command: 8 bit command, 24 bit address, no data phases */
+    uint32_t user = READ_REG(SPI_USER_REG);
+    uint32_t user1 = READ_REG(SPI_USER1_REG);
+    uint32_t user2 = READ_REG(SPI_USER2_REG);
+    WRITE_REG(SPI_USER_REG, (user & ~(SPI_USR_DUMMY | SPI_USR_MISO | SPI_USR_MOSI))
+              | SPI_USR_COMMAND | SPI_USR_ADDR);
+    WRITE_REG(SPI_USER1_REG, (user1 & ~SPI_USR_ADDR_BITLEN_M) | (23 << SPI_USR_ADDR_BITLEN_S));
+    WRITE_REG(SPI_USER2_REG, (7 << SPI_USR_COMMAND_BITLEN_S) | 0x52);
+    WRITE_REG(SPI_ADDR_REG, SPI_USR_ADDR_VALUE(addr & 0xffffff));
+    WRITE_REG(SPI_CMD_REG, SPI_USR);
+    while(READ_REG(SPI_CMD_REG) != 0)
+      { }
+    WRITE_REG(SPI_USER_REG, user);
+    WRITE_REG(SPI_USER1_REG, user1);
+    WRITE_REG(SPI_USER2_REG, user2);
+    return;
+  }
+
+  WRITE_REG(SPI_ADDR_REG, addr & 0xffffff);
+  WRITE_REG(SPI_CMD_REG, num_sectors == SECTORS_PER_BLOCK ? SPI_FLASH_BE : SPI_FLASH_SE);
+  while(READ_REG(SPI_CMD_REG) != 0)
+    { }
+}
+
+/* Erase the next sector or block, as chosen by flash_erase_plan().
 
    Updates fs.next_erase_sector & fs.remaining_erase_sector on success.
 
@@ -176,176 +636,789 @@ esp_command_error handle_flash_deflated_begin(uint32_t uncompressed_size, uint32
 
    Returns immediately if SPI flash not yet ready for a write operation.
 
+   If FLASH_BEGIN_SKIP_ERASED is set, sectors/blocks which already
+   read back as all 0xFF are skipped instead of erased.
+
    Does not wait for the erase to complete - the next SPI operation
    should check if a write operation is currently in progress.
  */
 static void start_next_erase(void)
 {
-  if(fs.remaining_erase_sector == 0)
+  if(fs.remaining_erase_sector == 0 && !fs.erase_chip)
     return; /* nothing left to erase */
   if(!spiflash_is_ready())
     return; /* don't wait for flash to be ready, caller will call again if needed */
 
-  spi_write_enable();
-
-  uint32_t command = SPI_FLASH_SE; /* sector erase, 4KB */
-  uint32_t sectors_to_erase = 1;
-  if(fs.remaining_erase_sector >= SECTORS_PER_BLOCK
-     && fs.next_erase_sector % SECTORS_PER_BLOCK == 0) {
-    /* perform a 64KB block erase if we have space for it */
-    command = SPI_FLASH_BE;
-    sectors_to_erase = SECTORS_PER_BLOCK;
+  if (fs.erase_chip) {
+    spi_write_enable();
+    WRITE_REG(SPI_CMD_REG, SPI_FLASH_CE);
+    while(READ_REG(SPI_CMD_REG) != 0)
+      { }
+    fs.erase_chip = false;
+    return;
   }
 
+  uint32_t sectors_to_erase = flash_erase_plan(fs.next_erase_sector, fs.remaining_erase_sector);
+
   uint32_t addr = fs.next_erase_sector * FLASH_SECTOR_SIZE;
-  spi_wait_ready();
-  WRITE_REG(SPI_ADDR_REG, addr & 0xffffff);
-  WRITE_REG(SPI_CMD_REG, command);
-  while(READ_REG(SPI_CMD_REG) != 0)
-    { }
+  if ((fs.flags & FLASH_BEGIN_SKIP_ERASED)
+      && flash_region_is_erased(addr, sectors_to_erase * FLASH_SECTOR_SIZE)) {
+    fs.remaining_erase_sector -= sectors_to_erase;
+    fs.next_erase_sector += sectors_to_erase;
+    erase_plan_next_segment();
+    return;
+  }
+
+  flash_erase_issue(fs.next_erase_sector, sectors_to_erase);
   fs.remaining_erase_sector -= sectors_to_erase;
   fs.next_erase_sector += sectors_to_erase;
+  erase_plan_next_segment();
 }
 
 /* Write data to flash (either direct for non-compressed upload, or
-   freshly decompressed.) Erases as it goes.
+   freshly decompressed.) Erases as it goes. 'length' fits in the
+   current segment.
 
    Updates fs.remaining_erase_sector, fs.next_write, and fs.remaining
 */
-void handle_flash_data(void *data_buf, uint32_t length) {
+static void flash_data_write(void *data_buf, uint32_t length) {
   int last_sector;
 
-  if (length > fs.remaining) {
-      /* Trim the final block, as it may have padding beyond
-         the length we are writing */
-      length = fs.remaining;
-  }
-
-  if (length == 0) {
-      return;
-  }
-
   /* what sector is this write going to end in?
      make sure we've erased at least that far.
   */
   last_sector = (fs.next_write + length) / FLASH_SECTOR_SIZE;
+  uint32_t start_cycles = stub_ccount();
   while(fs.remaining_erase_sector > 0 && fs.next_erase_sector <= last_sector) {
     start_next_erase();
   }
   while(!spiflash_is_ready())
     {}
+  uint32_t write_cycles = stub_ccount();
+  stub_stats.cycles_erase_wait += write_cycles - start_cycles;
 
   /* do the actual write */
-  if (SPIWrite(fs.next_write, data_buf, length)) {
+  if (((uintptr_t)data_buf & 3) == 0) {
+    flash_program_begin(fs.next_write, data_buf, length);
+    while (!flash_program_poll()) {
+      /* flash chip is busy with a page, send any queued output meanwhile */
+      stub_io_idle_hook();
+    }
+  } else if (SPIWrite(fs.next_write, data_buf, length)) {
+    /* ROM code copes with buffers that aren't word aligned */
     fs.last_error = ESP_FAILED_SPI_OP;
   }
+  stub_stats.cycles_flash_write += stub_ccount() - write_cycles;
   fs.next_write += length;
   fs.remaining -= length;
+  flash_segment_next();
 }
 
 #if !ESP8266
 /* Write encrypted data to flash (either direct for non-compressed upload, or
-   freshly decompressed.) Erases as it goes.
+   freshly decompressed.) Erases as it goes. 'length' fits in the
+   current segment.
 
    Updates fs.remaining_erase_sector, fs.next_write, and fs.remaining
 */
-void handle_flash_encrypt_data(void *data_buf, uint32_t length) {
+static void flash_encrypt_data_write(void *data_buf, uint32_t length) {
   int last_sector;
-  int res;
-
-#if ESP32S2_OR_LATER
-  SPI_Write_Encrypt_Enable();
-#endif
-
-  if (length > fs.remaining) {
-      /* Trim the final block, as it may have padding beyond
-         the length we are writing */
-      length = fs.remaining;
-  }
-
-  if (length == 0) {
-      return;
-  }
 
   /* what sector is this write going to end in?
      make sure we've erased at least that far.
   */
   last_sector = (fs.next_write + length) / FLASH_SECTOR_SIZE;
+  uint32_t start_cycles = stub_ccount();
   while(fs.remaining_erase_sector > 0 && fs.next_erase_sector <= last_sector) {
     start_next_erase();
   }
   while(!spiflash_is_ready())
     {}
+  uint32_t write_cycles = stub_ccount();
+  stub_stats.cycles_erase_wait += write_cycles - start_cycles;
 
   /* do the actual write */
-#if ESP32
-  res = esp_rom_spiflash_write_encrypted(fs.next_write, data_buf, length);
-#else
-  res = SPI_Encrypt_Write(fs.next_write, data_buf, length);
-#endif
-
-  if (res) {
+  if (!flash_encrypt_write(fs.next_write, data_buf, length)) {
     fs.last_error = ESP_FAILED_SPI_OP;
   }
+  stub_stats.cycles_flash_write += stub_ccount() - write_cycles;
   fs.next_write += length;
   fs.remaining -= length;
+  flash_segment_next();
+}
 
-#if ESP32S2_OR_LATER
-  SPI_Write_Encrypt_Disable();
-#endif
+void handle_flash_encrypt_data(void *data_buf, uint32_t length) {
+  /* a block can carry on into the next segment, anything
+     after the last one is padding */
+  while (length > 0 && fs.remaining > 0) {
+    uint32_t n = (length > fs.remaining) ? fs.remaining : length;
+    flash_encrypt_data_write(data_buf, n);
+    data_buf += n;
+    length -= n;
+  }
 }
 
 #endif // !ESP8266
 
+void handle_flash_data(void *data_buf, uint32_t length) {
+#if !ESP8266
+  if (fs.flags & FLASH_BEGIN_ENCRYPT) {
+    handle_flash_encrypt_data(data_buf, length);
+    return;
+  }
+#endif
+
+  /* a block can carry on into the next segment, anything
+     after the last one is padding */
+  while (length > 0 && fs.remaining > 0) {
+    uint32_t n = (length > fs.remaining) ? fs.remaining : length;
+    flash_data_write(data_buf, n);
+    data_buf += n;
+    length -= n;
+  }
+}
+
+/* Write-behind for deflated writes: hand the next part of inflate_out_buf
+   to the page program engine, once the last part is done and the flash
+   has been erased for it. Never waits for the flash chip, so the caller
+   can carry on inflating meanwhile.
+
+   Normally only whole sectors of output are written, unless 'all' is set.
+*/
+static void write_behind_poll(bool all)
+{
+  if (!flash_program_poll()) {
+    return; /* still issuing page programs for the last part */
+  }
+  uint32_t len = fs.out_len - fs.out_flushed;
+  if (len > FLASH_SECTOR_SIZE) {
+    len = FLASH_SECTOR_SIZE;
+  }
+  if (fs.remaining == 0) {
+    /* trailing output beyond the length we are writing */
+    fs.out_flushed = fs.out_len;
+    return;
+  }
+  if (len > fs.remaining) {
+    len = fs.remaining; /* rest is for the next segment */
+  }
+  if (len == 0 || (len < FLASH_SECTOR_SIZE && len < fs.remaining && !all)) {
+    start_next_erase();
+    return;
+  }
+
+  uint32_t last_sector = (fs.next_write + len - 1) / FLASH_SECTOR_SIZE;
+  if (fs.remaining_erase_sector > 0 && fs.next_erase_sector <= last_sector) {
+    start_next_erase();
+    return;
+  }
+
+#if !ESP8266
+  if (fs.flags & FLASH_BEGIN_ENCRYPT) {
+    /* no background programming for these, the ROM waits for each write */
+    while (!spiflash_is_ready())
+      { }
+    if (!flash_encrypt_write(fs.next_write, inflate_out_buf + fs.out_flushed, len)) {
+      fs.last_error = ESP_FAILED_SPI_OP;
+    }
+  } else
+#endif
+  {
+    flash_program_begin(fs.next_write, inflate_out_buf + fs.out_flushed, len);
+    flash_program_poll();
+  }
+  fs.out_flushed += len;
+  fs.next_write += len;
+  fs.remaining -= len;
+  flash_segment_next();
+}
+
+/* Keep the flash chip busy erasing or programming sectors which are
+   already decompressed. With the flash worker it's enough to make sure
+   that is running, it picks up fs.out_len as it grows. */
+static void write_behind_kick(void)
+{
+#if STUB_DUAL_CORE
+  if (s_worker_state == WORKER_IDLE) {
+    worker_barrier();
+    s_worker_state = WORKER_RUN;
+  }
+#else
+  write_behind_poll(false);
+#endif
+}
+
+#if STUB_DUAL_CORE
+static void flash_worker_main(void)
+{
+  while (true) {
+    worker_barrier();
+    uint32_t state = s_worker_state;
+    if (state == WORKER_RUN) {
+      write_behind_poll(false);
+    } else if (state == WORKER_STOP) {
+      s_worker_state = WORKER_IDLE;
+    }
+  }
+}
+#endif
+
+void flash_worker_start(void)
+{
+#if STUB_DUAL_CORE
+  s_worker_state = WORKER_IDLE;
+  worker_barrier();
+  /* (same sequence as ESP-IDF uses to start the second core) */
+#if ESP32
+  if (!(READ_REG(DPORT_APPCPU_CTRL_B_REG) & DPORT_APPCPU_CLKGATE_EN)) {
+    REG_SET_MASK(DPORT_APPCPU_CTRL_B_REG, DPORT_APPCPU_CLKGATE_EN);
+    REG_CLR_MASK(DPORT_APPCPU_CTRL_C_REG, DPORT_APPCPU_RUNSTALL);
+  }
+  REG_SET_MASK(DPORT_APPCPU_CTRL_A_REG, DPORT_APPCPU_RESETTING);
+  REG_CLR_MASK(DPORT_APPCPU_CTRL_A_REG, DPORT_APPCPU_RESETTING);
+#else
+  if (!(READ_REG(SYSTEM_CORE_1_CONTROL_0_REG) & SYSTEM_CONTROL_CORE_1_CLKGATE_EN)) {
+    REG_SET_MASK(SYSTEM_CORE_1_CONTROL_0_REG, SYSTEM_CONTROL_CORE_1_CLKGATE_EN);
+    REG_CLR_MASK(SYSTEM_CORE_1_CONTROL_0_REG, SYSTEM_CONTROL_CORE_1_RUNSTALL);
+  }
+  REG_SET_MASK(SYSTEM_CORE_1_CONTROL_0_REG, SYSTEM_CONTROL_CORE_1_RESETING);
+  REG_CLR_MASK(SYSTEM_CORE_1_CONTROL_0_REG, SYSTEM_CONTROL_CORE_1_RESETING);
+#endif
+  /* the ROM starts it on its own APP_CPU stack */
+  ets_set_appcpu_boot_addr((uint32_t)flash_worker_main);
+#endif
+}
+
+void flash_worker_stop(void)
+{
+#if STUB_DUAL_CORE
+  write_behind_park();
+  /* hold it in reset, whatever runs next may overwrite the stub */
+#if ESP32
+  REG_SET_MASK(DPORT_APPCPU_CTRL_A_REG, DPORT_APPCPU_RESETTING);
+#else
+  REG_SET_MASK(SYSTEM_CORE_1_CONTROL_0_REG, SYSTEM_CONTROL_CORE_1_RESETING);
+#endif
+#endif
+}
+
+/* Write out everything in inflate_out_buf, waits until it's done */
+static void write_behind_drain(void)
+{
+  uint32_t start_cycles = stub_ccount();
+  write_behind_park(); /* the PRO_CPU finishes off */
+  while (fs.out_flushed < fs.out_len || !flash_program_poll()) {
+    write_behind_poll(true);
+  }
+  stub_stats.cycles_flash_write += stub_ccount() - start_cycles;
+}
+
 void handle_flash_deflated_data(void *data_buf, uint32_t length) {
-  static uint8_t out_buf[32768];
-  static uint8_t *next_out = out_buf;
-  int status = TINFL_STATUS_NEEDS_MORE_INPUT;
+  int status = fs.inflate_status;
 
-  while(length > 0 && fs.remaining > 0 && status > TINFL_STATUS_DONE) {
+  /* (tinfl may still have output left over after consuming the
+     last of the input, if the window filled up.) Carries on until the
+     end of the zlib stream even once all of the output is written: the
+     last block(s) may only have the end of block code & adler32 left. */
+  while((length > 0 || status == TINFL_STATUS_HAS_MORE_OUTPUT)
+        && status > TINFL_STATUS_DONE) {
     size_t in_bytes = length; /* input remaining */
-    size_t out_bytes = out_buf + sizeof(out_buf) - next_out; /* output space remaining */
+    if (in_bytes > INFLATE_IN_SLICE) {
+      in_bytes = INFLATE_IN_SLICE;
+    }
+    size_t out_bytes = sizeof(inflate_out_buf) - fs.out_len; /* output space remaining */
     int flags = TINFL_FLAG_PARSE_ZLIB_HEADER;
-    if(fs.remaining_compressed > length) {
+    if(fs.remaining_compressed > in_bytes) {
       flags |= TINFL_FLAG_HAS_MORE_INPUT;
     }
 
-    /* start an opportunistic erase: decompressing takes time, so might as
-       well be running a SPI erase in the background. */
-    start_next_erase();
+    /* keep the flash chip busy erasing or programming
+       sectors which are already decompressed */
+    write_behind_kick();
 
-    status = tinfl_decompress(&fs.inflator, data_buf, &in_bytes,
-                     out_buf, next_out, &out_bytes,
+    uint32_t start_cycles = stub_ccount();
+    status = tinfl_decompress(&inflator, data_buf, &in_bytes,
+                     inflate_out_buf, inflate_out_buf + fs.out_len, &out_bytes,
                      flags);
+    stub_stats.cycles_inflate += stub_ccount() - start_cycles;
 
     fs.remaining_compressed -= in_bytes;
     length -= in_bytes;
     data_buf += in_bytes;
 
-    next_out += out_bytes;
-    size_t bytes_in_out_buf = next_out - out_buf;
-    if (status <= TINFL_STATUS_DONE || bytes_in_out_buf == sizeof(out_buf)) {
-      // Output buffer full, or done
-      handle_flash_data(out_buf, bytes_in_out_buf);
-      next_out = out_buf;
+    write_behind_publish(fs.out_len + out_bytes);
+    if (status <= TINFL_STATUS_DONE || fs.out_len == sizeof(inflate_out_buf)) {
+      /* Done, or tinfl wraps around to the start of the buffer next
+         (overwriting it), so everything has to be written out first */
+      write_behind_drain();
+      fs.out_len = 0;
+      fs.out_flushed = 0;
     }
   } // while
+  fs.inflate_status = status;
 
   if (status < TINFL_STATUS_DONE) {
     /* error won't get sent back to esptool.py until next block is sent */
     fs.last_error = ESP_INFLATE_ERROR;
   }
 
-  if (status == TINFL_STATUS_DONE && fs.remaining > 0) {
+  if (status == TINFL_STATUS_DONE && fs.out_total < fs.out_expected) {
     fs.last_error = ESP_NOT_ENOUGH_DATA;
   }
-  if (status != TINFL_STATUS_DONE && fs.remaining == 0) {
+  if (fs.out_total > fs.out_expected) {
     fs.last_error = ESP_TOO_MUCH_DATA;
   }
 }
 
+esp_command_error handle_flash_lz4_begin(uint32_t uncompressed_size, uint32_t offset, uint32_t flags) {
+  esp_command_error err = handle_flash_begin(uncompressed_size, offset, flags);
+  fs.out_len = 0;
+  fs.out_flushed = 0;
+  fs.lz4_state = LZ4_HEADER;
+  fs.lz4_count = 0;
+  fs.lz4_block_left = 0;
+  return err;
+}
+
+/* Decode 'len' bytes of an LZ4 block stream (see FLASH_LZ4_STORED) into
+   inflate_out_buf. Can stop and resume anywhere, even in the middle of a
+   length or offset.
+
+   Each block is decoded to a contiguous part of the buffer, so matches
+   are a plain copy backwards from the output pointer. Before starting a
+   block that might not fit, everything so far is written out.
+*/
+static esp_command_error lz4_decode(const uint8_t *in, uint32_t len)
+{
+  const uint8_t *end = in + len;
+  uint8_t *out = inflate_out_buf + fs.out_len;
+  uint32_t count = fs.lz4_count;
+
+  while (in < end) {
+    if (fs.lz4_state == LZ4_DONE) {
+      return ESP_TOO_MUCH_DATA;
+    }
+    if (fs.lz4_state == LZ4_HEADER) {
+      fs.lz4_block_left |= (uint32_t)*in++ << (8 * count);
+      if (++count < 4) {
+        continue;
+      }
+      count = 0;
+      if (fs.lz4_block_left == 0) {
+        fs.lz4_state = LZ4_DONE;
+        continue;
+      }
+      write_behind_publish(out - inflate_out_buf);
+      if (fs.out_len + FLASH_LZ4_MAX_BLOCK_SIZE > sizeof(inflate_out_buf)) {
+        /* encrypted writes have to stay aligned, so hold back any
+           partial unit at the end and move it to the start */
+        uint32_t keep = 0;
+        write_behind_park();
+        if (fs.flags & FLASH_BEGIN_ENCRYPT) {
+          keep = (fs.out_len - fs.out_flushed) % FLASH_ENCRYPT_ALIGN;
+        }
+        fs.out_len -= keep;
+        write_behind_drain();
+        for (uint32_t i = 0; i < keep; i++) {
+          inflate_out_buf[i] = inflate_out_buf[fs.out_len + i];
+        }
+        fs.out_len = keep;
+        fs.out_flushed = 0;
+        out = inflate_out_buf + keep;
+      }
+      fs.lz4_block_start = fs.out_len;
+      if (fs.lz4_block_left & FLASH_LZ4_STORED) {
+        fs.lz4_block_left &= ~FLASH_LZ4_STORED;
+        fs.lz4_state = LZ4_LITERALS; /* the whole block is one literal run */
+        count = fs.lz4_block_left;
+      } else {
+        fs.lz4_state = LZ4_TOKEN;
+      }
+      continue;
+    }
+
+    const uint8_t *block = inflate_out_buf + fs.lz4_block_start;
+    const uint8_t *block_out_end = block + FLASH_LZ4_MAX_BLOCK_SIZE;
+    const uint8_t *p = in;
+    const uint8_t *p_end = ((uint32_t)(end - in) > fs.lz4_block_left) ? in + fs.lz4_block_left : end;
+
+    while (p < p_end) {
+      uint8_t b;
+      uint32_t n;
+      switch (fs.lz4_state) {
+      case LZ4_TOKEN:
+        fs.lz4_token = *p++;
+        count = fs.lz4_token >> 4;
+        fs.lz4_state = (count == 15) ? LZ4_LITERALS_EXT : (count ? LZ4_LITERALS : LZ4_OFFSET_LO);
+        break;
+      case LZ4_LITERALS_EXT:
+        b = *p++;
+        count += b;
+        if (b != 255) {
+          fs.lz4_state = LZ4_LITERALS;
+        }
+        break;
+      case LZ4_LITERALS:
+        n = p_end - p;
+        if (n > count) {
+          n = count;
+        }
+        if (n > (uint32_t)(block_out_end - out)) {
+          return ESP_INFLATE_ERROR;
+        }
+        count -= n;
+        while (n--) {
+          *out++ = *p++;
+        }
+        if (count == 0) {
+          fs.lz4_state = LZ4_OFFSET_LO;
+        }
+        break;
+      case LZ4_OFFSET_LO:
+        fs.lz4_offset = *p++;
+        fs.lz4_state = LZ4_OFFSET_HI;
+        break;
+      case LZ4_OFFSET_HI:
+        fs.lz4_offset |= *p++ << 8;
+        if (fs.lz4_offset == 0 || fs.lz4_offset > (uint32_t)(out - block)) {
+          return ESP_INFLATE_ERROR; /* match before the start of the block */
+        }
+        count = (fs.lz4_token & 15) + 4;
+        fs.lz4_state = (count == 15 + 4) ? LZ4_MATCH_EXT : LZ4_MATCH;
+        break;
+      case LZ4_MATCH_EXT:
+        b = *p++;
+        count += b;
+        if (b != 255) {
+          fs.lz4_state = LZ4_MATCH;
+        }
+        break;
+      default:
+        return ESP_INFLATE_ERROR;
+      }
+
+      if (fs.lz4_state == LZ4_MATCH) {
+        if (count > (uint32_t)(block_out_end - out)) {
+          return ESP_INFLATE_ERROR;
+        }
+        /* byte at a time, the match can overlap its own output */
+        const uint8_t *from = out - fs.lz4_offset;
+        while (count--) {
+          *out++ = *from++;
+        }
+        count = 0;
+        fs.lz4_state = LZ4_TOKEN;
+      }
+    }
+
+    fs.lz4_block_left -= p - in;
+    in = p;
+    if (fs.lz4_block_left == 0) {
+      /* blocks end with literals, or at least not part way through a sequence */
+      if (fs.lz4_state != LZ4_OFFSET_LO && fs.lz4_state != LZ4_TOKEN) {
+        return ESP_INFLATE_ERROR;
+      }
+      fs.lz4_state = LZ4_HEADER;
+    }
+  }
+
+  write_behind_publish(out - inflate_out_buf);
+  fs.lz4_count = count;
+  return ESP_OK;
+}
+
+void handle_flash_lz4_data(void *data_buf, uint32_t length) {
+  esp_command_error err = ESP_OK;
+
+  while (length > 0 && err == ESP_OK) {
+    uint32_t in_bytes = length;
+    if (in_bytes > LZ4_IN_SLICE) {
+      in_bytes = LZ4_IN_SLICE;
+    }
+
+    /* keep the flash chip busy erasing or programming
+       sectors which are already decompressed */
+    write_behind_kick();
+
+    uint32_t start_cycles = stub_ccount();
+    err = lz4_decode(data_buf, in_bytes);
+    stub_stats.cycles_inflate += stub_ccount() - start_cycles;
+
+    length -= in_bytes;
+    data_buf += in_bytes;
+  }
+
+  if (err == ESP_OK && fs.lz4_state == LZ4_DONE) {
+    if (fs.out_total > fs.out_expected) {
+      err = ESP_TOO_MUCH_DATA;
+    }
+    write_behind_drain();
+    if (fs.remaining > 0) {
+      err = ESP_NOT_ENOUGH_DATA;
+    }
+  }
+
+  if (err != ESP_OK) {
+    /* error won't get sent back to esptool.py until next block is sent */
+    fs.last_error = err;
+  }
+}
+
+esp_command_error handle_mem_deflated_begin(void)
+{
+  /* the inflator & window are only ours while no flash write is going on */
+  if (fs.in_flash_mode) {
+    return ESP_IN_FLASH_MODE;
+  }
+  write_behind_park();
+  while (!flash_program_poll())
+    { }
+  flash_encrypt_end();
+
+  tinfl_init(&inflator);
+  fs.out_len = 0;
+  fs.out_flushed = 0;
+  return ESP_OK;
+}
+
+esp_command_error handle_mem_deflated_data(void *data_buf, uint32_t length)
+{
+  int status = TINFL_STATUS_NEEDS_MORE_INPUT;
+  esp_command_error err = ESP_OK;
+
+  /* Inflate into the window, not straight to the destination: IRAM only
+     takes word writes, tinfl writes (and reads back matches) a byte at a
+     time. Whole words are copied out of the window with handle_mem_data(). */
+  while((length > 0 || status == TINFL_STATUS_HAS_MORE_OUTPUT)
+        && status > TINFL_STATUS_DONE && err == ESP_OK) {
+    size_t in_bytes = length;
+    size_t out_bytes = sizeof(inflate_out_buf) - fs.out_len;
+
+    uint32_t start_cycles = stub_ccount();
+    status = tinfl_decompress(&inflator, data_buf, &in_bytes,
+                     inflate_out_buf, inflate_out_buf + fs.out_len, &out_bytes,
+                     TINFL_FLAG_PARSE_ZLIB_HEADER | TINFL_FLAG_HAS_MORE_INPUT);
+    stub_stats.cycles_inflate += stub_ccount() - start_cycles;
+
+    length -= in_bytes;
+    data_buf += in_bytes;
+    fs.out_len += out_bytes;
+
+    uint32_t n = fs.out_len - fs.out_flushed;
+    if (status != TINFL_STATUS_DONE) {
+      n &= ~3; /* rest goes with the next output */
+    }
+    err = handle_mem_data(inflate_out_buf + fs.out_flushed, n);
+    fs.out_flushed += n;
+    if (fs.out_len == sizeof(inflate_out_buf)) {
+      fs.out_len = 0;
+      fs.out_flushed = 0;
+    }
+  }
+
+  if (err != ESP_OK) {
+    return err;
+  }
+  if (status < TINFL_STATUS_DONE) {
+    return ESP_INFLATE_ERROR;
+  }
+  if (length > 0) {
+    return ESP_TOO_MUCH_DATA; /* after the end of the zlib stream */
+  }
+  return ESP_OK;
+}
+
+void stub_flash_idle_hook(void)
+{
+  /* While the host is still sending the next block, keep the flash chip busy
+     erasing sectors further along in this session. By the time the data for
+     them arrives, handle_flash_data() usually finds them already erased.
+     For deflated writes, also carry on writing the sectors decompressed so far.
+
+     Outside of a session, this is what runs ERASE_ASYNC erases. */
+#if STUB_DUAL_CORE
+  if (s_worker_state != WORKER_IDLE) {
+    return; /* the flash worker is doing all that */
+  }
+#endif
+  if (fs.in_flash_mode && fs.out_flushed < fs.out_len) {
+    write_behind_poll(false);
+  } else {
+    start_next_erase();
+  }
+}
+
+esp_command_error handle_flash_erase(uint32_t addr, uint32_t len)
+{
+  if (addr % FLASH_SECTOR_SIZE != 0) return 0x32;
+  if (len % FLASH_SECTOR_SIZE != 0) return 0x33;
+  if (SPIUnlock() != 0) return 0x34;
+
+  uint32_t sector = addr / FLASH_SECTOR_SIZE;
+  uint32_t num_sectors = len / FLASH_SECTOR_SIZE;
+  while (num_sectors > 0) {
+    uint32_t n = flash_erase_plan(sector, num_sectors);
+    flash_erase_issue(sector, n);
+    sector += n;
+    num_sectors -= n;
+  }
+  while (!spiflash_is_ready())
+    { }
+
+  return ESP_OK;
+}
+
+/* Point the erase-ahead state at 'num_sectors' from 'sector', with no
+   session segments or flags after them. Only valid outside of a session,
+   nothing else uses that state then. */
+static void erase_ahead_reset(uint32_t sector, uint32_t num_sectors)
+{
+  fs.flags = 0;
+  fs.num_segments = 0;
+  fs.next_erase_sector = sector;
+  fs.remaining_erase_sector = num_sectors;
+}
+
+esp_command_error handle_flash_erase_async(uint32_t addr, uint32_t len)
+{
+  if (fs.in_flash_mode) {
+    return ESP_IN_FLASH_MODE; /* the session's own erase-ahead state */
+  }
+  if (addr % FLASH_SECTOR_SIZE != 0) return 0x32;
+  if (len % FLASH_SECTOR_SIZE != 0) return 0x33;
+  write_behind_park();
+  if (SPIUnlock() != 0) return 0x34;
+
+  erase_ahead_reset(addr / FLASH_SECTOR_SIZE, len / FLASH_SECTOR_SIZE);
+  start_next_erase();
+  return ESP_OK;
+}
+
+esp_command_error handle_flash_erase_chip_async(void)
+{
+  if (fs.in_flash_mode) {
+    return ESP_IN_FLASH_MODE;
+  }
+  write_behind_park();
+  if (SPIUnlock() != 0) return 0x34;
+
+  fs.erase_chip = true;
+  start_next_erase();
+  return ESP_OK;
+}
+
+uint32_t get_flash_erase_remaining(void)
+{
+  write_behind_park();
+  uint32_t remaining = fs.remaining_erase_sector;
+  if (fs.erase_chip || !spiflash_is_ready()) {
+    remaining++; /* (chip erase counts as one sector) */
+  }
+  return remaining;
+}
+
+void flash_erase_wait(void)
+{
+  write_behind_park();
+  if (fs.in_flash_mode) {
+    return; /* erasing is part of the session, it finishes as data is written */
+  }
+  uint32_t start_cycles = stub_ccount();
+  while (fs.remaining_erase_sector > 0 || fs.erase_chip) {
+    start_next_erase();
+  }
+  while (!spiflash_is_ready())
+    { }
+  stub_stats.cycles_erase_wait += stub_ccount() - start_cycles;
+}
+
+/* Sector buffer for handle_flash_copy() & handle_flash_fill(), too big
+   for the ROM's stack with the write path nested under it. They only run
+   outside of a flashing session, and their own handle_flash_begin() drops
+   whatever was left in the inflate window, so they borrow its first
+   sector (ESP8266 has no DRAM to spare for one of their own). */
+#define COPY_BUF_SIZE FLASH_SECTOR_SIZE
+
+/* Finish a session handle_flash_copy() or handle_flash_fill() started */
+static esp_command_error flash_copy_end(esp_command_error err)
+{
+  esp_command_error end_err = handle_flash_end();
+  fs.in_flash_mode = false; /* (even if it stopped short) */
+  return (err != ESP_OK) ? err : end_err;
+}
+
+esp_command_error handle_flash_copy(uint32_t src, uint32_t dst, uint32_t len)
+{
+  uint32_t *buf = (uint32_t *)inflate_out_buf;
+
+  if (fs.in_flash_mode) {
+    return ESP_IN_FLASH_MODE;
+  }
+  if (src % 4 != 0 || dst % 4 != 0 || src + len < src
+      || dst + len + FLASH_SECTOR_SIZE - 1 < dst) {
+    return ESP_BAD_ADDRESS;
+  }
+  /* handle_flash_begin() erases every sector dst touches, not just the
+     bytes written, so the source has to stay clear of all of them */
+  uint32_t erase_start = dst & ~(FLASH_SECTOR_SIZE - 1);
+  uint32_t erase_end = (dst + len + FLASH_SECTOR_SIZE - 1) & ~(FLASH_SECTOR_SIZE - 1);
+  if (len > 0 && src < erase_end && erase_start < src + len) {
+    return ESP_BAD_ADDRESS; /* would read back what it has already erased */
+  }
+
+  esp_command_error err = handle_flash_begin(len, dst, 0);
+  while (err == ESP_OK && len > 0) {
+    uint32_t n = (len > COPY_BUF_SIZE) ? COPY_BUF_SIZE : len;
+    if (SPIRead(src, buf, n) != 0) {
+      err = ESP_FAILED_SPI_OP;
+      break;
+    }
+    handle_flash_data(buf, n);
+    src += n;
+    len -= n;
+  }
+  return flash_copy_end(err);
+}
+
+esp_command_error handle_flash_fill(uint32_t dst, uint32_t len, const uint8_t *pattern, uint32_t pattern_len)
+{
+  uint32_t *buf = (uint32_t *)inflate_out_buf;
+  uint8_t *bytes = inflate_out_buf;
+
+  if (fs.in_flash_mode) {
+    return ESP_IN_FLASH_MODE;
+  }
+  if (pattern_len == 0 || pattern_len > FLASH_FILL_MAX_PATTERN) {
+    return ESP_BAD_DATA_LEN;
+  }
+  if (dst % 4 != 0 || dst + len < dst) {
+    return ESP_BAD_ADDRESS;
+  }
+
+  /* as much of the pattern as fits, in whole repeats that are also
+     whole words, so every chunk written starts at the start of it and
+     stays aligned */
+  uint32_t unit = pattern_len;
+  while (unit % 4 != 0) {
+    unit += pattern_len;
+  }
+  uint32_t chunk = COPY_BUF_SIZE - COPY_BUF_SIZE % unit;
+  for (uint32_t i = 0; i < chunk; i++) {
+    bytes[i] = pattern[i % pattern_len];
+  }
+
+  esp_command_error err = handle_flash_begin(len, dst, 0);
+  while (err == ESP_OK && len > 0) {
+    uint32_t n = (len > chunk) ? chunk : len;
+    handle_flash_data(buf, n);
+    len -= n;
+  }
+  return flash_copy_end(err);
+}
+
 esp_command_error handle_flash_end(void)
 {
+  write_behind_park();
   if (!fs.in_flash_mode) {
     return ESP_NOT_IN_FLASH_MODE;
   }
@@ -355,5 +1428,6 @@ esp_command_error handle_flash_end(void)
   }
 
   fs.in_flash_mode = false;
+  flash_encrypt_end();
   return fs.last_error;
 }
@@ -23,16 +23,55 @@ import os.path
 import sys
 import zlib
 import re
+import struct
 import argparse
 
+# sizeof(tinfl_decompressor) on the 32-bit targets, which stub_loader()
+# puts between the compressed payload and the inflated text & data
+TINFL_DECOMPRESSOR_SIZE = 10992
+
 sys.path.append('..')
 import esptool
 
-def wrap_stub(elf_file):
+def region_usage(map_file):
+    """ (name, bytes used, length) of each MEMORY region in a linker map file,
+    counting from the region's origin to the end of the last section in it """
+    regions = []
+    sections = []
+    in_memory = False
+    with open(map_file) as f:
+        for line in f:
+            if line.startswith('Memory Configuration'):
+                in_memory = True
+            elif line.startswith('Linker script and memory map'):
+                in_memory = False
+            elif in_memory:
+                m = re.match(r'(\S+)\s+0x([0-9a-f]+)\s+0x([0-9a-f]+)', line)
+                if m and m.group(1) != '*default*':
+                    regions.append((m.group(1), int(m.group(2), 16), int(m.group(3), 16)))
+            else:
+                # output sections start in the first column, their input sections don't
+                m = re.match(r'(\.\S+)\s+0x([0-9a-f]+)\s+0x([0-9a-f]+)', line)
+                if m:
+                    sections.append((int(m.group(2), 16), int(m.group(3), 16)))
+    usage = []
+    for (name, origin, length) in regions:
+        end = max([origin] + [addr + size for (addr, size) in sections if origin <= addr < origin + length])
+        usage.append((name, end - origin, length))
+    return usage
+
+
+def wrap_stub(elf_file, compress=True):
     """ Wrap an ELF file into a stub 'dict' """
     print('Wrapping ELF file %s...' % elf_file)
     e = esptool.ELFFile(elf_file)
 
+    # the link fails if a region overflows, this shows how close it is
+    map_file = os.path.splitext(elf_file)[0] + '.map'
+    if os.path.exists(map_file):
+        for (name, used, length) in region_usage(map_file):
+            print('Stub %s: %d of %d bytes' % (name, used, length), file=sys.stderr)
+
     text_section = e.get_section('.text')
     try:
         data_section = e.get_section('.data')
@@ -49,14 +88,65 @@ def wrap_stub(elf_file):
 
     # Pad text with NOPs to mod 4.
     if len(stub['text']) % 4 != 0:
-        stub['text'] += (4 - (len(stub['text']) % 4)) * '\0'
+        stub['text'] += (4 - (len(stub['text']) % 4)) * b'\0'
 
     print('Stub text: %d @ 0x%08x, data: %d @ 0x%08x, entry @ 0x%x' % (
         len(stub['text']), stub['text_start'],
         len(stub.get('data', '')), stub.get('data_start', 0),
         stub['entry']), file=sys.stderr)
+
+    if compress:
+        compressed = compress_stub(e, stub)
+        if compressed is not None:
+            return compressed
     return stub
 
+
+def compress_stub(e, stub):
+    """ Compressed stub image: the ROM loader only uploads the small .loader
+    section and the zlib compressed text & data, which stub_loader()
+    inflates into place.
+
+    Returns None if the ELF file has no loader (ESP8266 has no tinfl in ROM),
+    or if it wouldn't be any smaller. Fails if the payload, the decompressor
+    and the inflated text & data don't all fit in the receive buffers.
+    """
+    try:
+        loader = e.get_section('.loader')
+    except ValueError:
+        return None
+    payload_start, loader_entry, payload_end = struct.unpack('<III', loader.data[:12])
+    text = stub['text']
+    data = stub.get('data', b'')
+    if len(data) % 4 != 0:
+        data += (4 - (len(data) % 4)) * b'\0'
+    z = zlib.compress(text + data, 9)
+    payload = struct.pack('<I', len(z)) + z
+    if len(payload) % 4 != 0:
+        payload += (4 - (len(payload) % 4)) * b'\0'
+    if len(loader.data) + len(payload) >= len(text) + len(data):
+        return None
+    needed = len(payload) + TINFL_DECOMPRESSOR_SIZE + len(text) + len(data)
+    if needed > payload_end - payload_start:
+        raise RuntimeError('Compressed stub needs %d bytes to unpack, only %d in the receive buffers @ 0x%08x' % (
+            needed, payload_end - payload_start, payload_start))
+
+    print('Compressed stub: loader %d @ 0x%08x, payload %d @ 0x%08x, entry @ 0x%x' % (
+        len(loader.data), loader.addr, len(payload), payload_start, loader_entry), file=sys.stderr)
+    return {
+        'loader': loader.data,
+        'loader_start': loader.addr,
+        'loader_entry': loader_entry,
+        'payload': payload,
+        'payload_start': payload_start,
+        # where the stub ends up, for esptool.py's overlap check
+        'text_start': stub['text_start'],
+        'text_len': len(text),
+        'data_start': stub.get('data_start', 0),
+        'data_len': len(data),
+        'entry': stub['entry'],
+    }
+
 PYTHON_TEMPLATE = """\
 ESP%sROM.STUB_CODE = eval(zlib.decompress(base64.b64decode(b\"\"\"
 %s\"\"\")))
@@ -118,10 +208,12 @@ if __name__ == '__main__':
     parser = argparse.ArgumentParser()
     parser.add_argument("--out-file", required=False, type=argparse.FileType('w'),
                         help="Output file name. If not specified, stubs are embedded into esptool.py.")
+    parser.add_argument("--no-compress", action="store_true",
+                        help="Always use the plain stub format, with uncompressed text & data.")
     parser.add_argument("elf_files", nargs="+", help="Stub ELF files to convert")
     args = parser.parse_args()
 
-    stubs = dict((stub_name(elf_file), wrap_stub(elf_file)) for elf_file in args.elf_files)
+    stubs = dict((stub_name(elf_file), wrap_stub(elf_file, not args.no_compress)) for elf_file in args.elf_files)
     if args.out_file:
         print('Dumping to Python snippet file %s.' % args.out_file.name)
         write_python_snippets(stubs, args.out_file)